@@ -8,14 +8,35 @@
 
 #define SCAN_DIST 20 // Number of scans for two peaks to be considered near
 #define MZ_DIST 0.05 // m/z gap for two peaks to be considered near
+#define HEADER_PAD 128 // Space reserved for msRun totals in streaming mode
+#define PENDING_PER_THREAD 2 // Nodes held back per decode thread when streaming
+#define WRITE_QUEUE 8 // Nodes queued per writer thread when streaming
+#define CSV_BUFFER (1 << 20) // Bytes of CSV collected per write
+#define CSV_LINE_MAX 1024 // Longest possible CSV line
+#define MAD_TO_SIGMA 1.4826 // Standard deviations per MAD of normal noise
+#define GRID_GAP 1.5 // TOF gap in grid steps that separates profile peaks
+#define HIST_BINS 48 // Power of 2 bins in summary histograms
+#define SUMMARY_TOP 10 // Highest peaks in summary unless -h is given
+#define LOCK_SCAN_TYPE "calibration" // scanType of scans with the lock mass
+#define DEFAULT_LOCK_TOLERANCE 0.1 // in u/e
+#define LOCK_ONLY ((intptr_t)-1) // Route of calibration scans kept only to measure
+#define HOLD_MAX 256 // Most scans held back waiting for calibration or later scans
+#define DEFAULT_PERSIST_TOLERANCE 0.02 // in u/e
+#define MIN_SMOOTH_K 2 // Narrowest quadratic Savitzky-Golay window that smooths at all
 
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <limits.h>
 #include <float.h>
 #include <assert.h>
+#include <math.h>
+#include <getopt.h>
 #include "mxmlmzXML.h"
+#include "mzXMLreader.h"
+#include "tofcodec.h"
 
 typedef struct {
 	float mz, I;
@@ -30,120 +51,702 @@ typedef struct {
 	double RT, mz, I;
 } peak;
 
+// A peak in the n-highest list, which is both a min-heap by I and a hash of
+// grid cells of (SCAN_DIST scans, 1 m/z) for finding near peaks
+typedef struct {
+	peak p;
+	unsigned long seq; // When last set, ordering peaks of equal I
+	int heap_pos;
+	long cell_scan, cell_mz;
+	int next; // Next peak in the same hash bucket, or -1
+} top_peak;
+
+typedef struct {
+	top_peak *peaks;
+	int *heap; // Indices into peaks, lowest I (and latest set) at the root
+	int *buckets; // First peak in each hash bucket, or -1
+	unsigned int mask; // Number of buckets - 1
+	unsigned long seq;
+} peak_heap;
+
+enum {
+	W_NODE, W_OPEN, W_RUN, W_CLOSE
+};
+
+struct outfile;
+
+// A detached node queued for the writer thread of an outfile
+typedef struct {
+	pool_task task;
+	struct outfile *out;
+	int what; // Whole node, start tag, msRun start tag or end tag
+	mxml_node_t *node;
+	bool used;
+} write_job;
+
+// An output file with the scans and peaks routed to it and its own totals
+typedef struct outfile {
+	char *name;
+	FILE *file;
+	int type, parity; // Scans kept: index into split_types, 1 odd, 0 even, -1 all
+	double min_mz, max_mz; // Peaks kept
+	unsigned int num, scan_count;
+	char *low_t_str, *high_t_str;
+	double low_t, high_t;
+	long header_pos; // Output offset of msRun totals in streaming mode
+	unsigned long noise_peaks, noise_removed; // Peaks in range, and those under the noise floor
+	mzXML_index index; // Output offsets of scans written in streaming mode
+	bool sha1_open; // Streaming output left open at the sha1 element
+	pool writer; // Single writer thread in streaming mode
+	char *csv; // CSV lines not yet written
+	size_t csv_length;
+	write_job jobs[WRITE_QUEUE];
+	int next_job;
+} outfile;
+
+// The last window_k scans of a scanType, unfiltered and sorted by m/z, which
+// smoothing and the persistence filter look back on
+typedef struct {
+	mzI_64 **peaks;
+	long *n;
+	int next, count; // Slot to fill next, and slots filled
+} scan_window;
+
+// Scan selection compiled from the command line by compile_filter, so that
+// select_scan tests each scan start tag in one pass over its attributes
+typedef struct {
+	const char **types; // scanTypes kept
+	int n_types;
+	bool by_type; // Route each kept scanType to its own outfiles
+	int ms_level; // msLevel kept, or 0 for all
+	char polarity; // polarity kept, '+' or '-', or 0 for both
+	bool check_num, check_t; // Whether num or retentionTime are limited
+	unsigned int min_num, max_num;
+	double min_t, max_t;
+} scan_filter;
+
+// Elements that sax_cb and stream_close treat specially, from element_id
+enum {
+	E_OTHER, E_MZXML, E_MSRUN, E_SCAN, E_PEAKS, E_DATAPROCESSING, E_DROPPED
+};
+
+// A point of the total ion current chromatogram
+typedef struct {
+	unsigned int num;
+	double RT, I;
+} tic_point;
+
+// Run statistics collected as scans go by in summary mode
+typedef struct {
+	char **type_names;
+	unsigned long *type_counts; // Scans of each scanType read
+	unsigned long *type_odd, *type_even; // Of them, with odd and even num
+	int n_types;
+	unsigned long scans, peaks; // Kept scans and their peaks
+	double total_I, low_t, high_t, low_mz, high_mz;
+	unsigned long peaks_hist[HIST_BINS], I_hist[HIST_BINS];
+	tic_point *tic;
+	long tic_size;
+} run_summary;
+
 void parse_command_line(int, char**);
-unsigned int strip_peaks(mxml_node_t *);
-void find_highest_peaks(mxml_node_t *, peak *);
+void parse_split(char *, char **);
+void make_outfiles(void);
+void compile_filter(void);
+mxml_node_t *load_window(mzXML_reader *);
+int scan_type_index(const char *);
+int outfile_type(int);
+int window_index(intptr_t);
+intptr_t select_scan(mxml_node_t *);
+bool routes_to(outfile *, intptr_t);
+void process_scans(outfile *, mxml_node_t *);
+void process_scan(outfile *, mxml_node_t *);
+void write_all(int, mxml_node_t *);
+void write_to(outfile *, int, mxml_node_t *);
+void write_job_cb(void *);
+void write_run_header(outfile *, mxml_node_t *);
+void patch_run_header(outfile *);
+void stream_close(mxml_node_t *);
+void finish_node(mxml_node_t *);
+void flush_pending(int);
+unsigned int strip_peaks(outfile *, mxml_node_t *);
+double noise_floor(void *, long, int);
+void centroid_peaks(mzXML_peaks *);
+bool is_lock_scan(mxml_node_t *);
+void measure_lock(mxml_node_t *);
+double drift_factor(double);
+bool lock_ready(mxml_node_t *);
+void filter_tree(mxml_node_t *);
+void filter_scan(mxml_node_t *, mxml_node_t **, int);
+void smooth_scan(mxml_node_t *, mzI_64 **, long *);
+void persist_scan(mxml_node_t *, mzI_64 **, long *);
+mzI_64 *sorted_peaks(mxml_node_t *, long *);
+int compare_mz(const void *, const void *);
+float select_nth(float *, long, long);
+int format_fixed3(char *, double);
+void csv_flush(outfile *);
+void heap_init(peak_heap *, int);
+void heap_offer(peak_heap *, unsigned int, double, double, double);
+void heap_set(peak_heap *, top_peak *, unsigned int, double, double, double);
+void heap_sift_down(peak_heap *, int);
+unsigned int heap_bucket(peak_heap *, long, long);
+void heap_free(peak_heap *);
+void find_highest_peaks(mxml_node_t *, peak_heap *);
+void count_scan_type(const char *, const char *);
+void summarise_scan(mxml_node_t *, mxml_node_t *);
+int log2_bin(double);
+void write_summary(FILE *);
+void write_histogram(FILE *, const char *, unsigned long *);
+void write_json_string(FILE *, const char *);
+int element_id(const char *);
 void sax_cb(mxml_node_t *, mxml_sax_event_t,void *);
-int compare_I_peak(const void *, const void *);
+int compare_top_peak(const void *, const void *);
 void usage(char**);
 
 // Global command line parameters with default values
 char *inputname = NULL, *outputname = NULL;
-FILE *input = NULL, *output = NULL;
-const char *scan_type = DEFAULT_SCAN_TYPE;
+FILE *input = NULL;
+const char **scan_types = NULL; // scanTypes kept, or DEFAULT_SCAN_TYPE if none
+int n_scan_types = 0;
+int ms_level = 0; // msLevel kept, or 0 for all
+char polarity = 0; // polarity kept, or 0 for both
 unsigned int n_highest = 0, min_num = 0, max_num = UINT_MAX;
 double min_t = 0, max_t = DBL_MAX, min_mz = 0, max_mz = DBL_MAX, min_I = 0;
+double noise_k = 0; // Noise floor in sigma above the median of each scan
+double lock_mz = 0, lock_tolerance = DEFAULT_LOCK_TOLERANCE; // Lock mass, or 0 for none
+int persist_k = 0; // Scans either side searched for a neighbour of each peak, or 0
+double persist_tolerance = DEFAULT_PERSIST_TOLERANCE;
+int smooth_k = 0; // Scans either side in the Savitzky-Golay window, or 0
 bool compress_peaks = true, verbose = false, renumber_scans = true;
+bool streaming = false, split_parity = false, centroid = false, summary = false;
+bool tof_peaks = false; // Code peaklists as TOF grid indices instead of zlib
+int n_threads = 0;
+char **split_types = NULL; // scanTypes split into their own outfiles
+double *split_mz = NULL; // Increasing m/z edges of blocks split into outfiles
+int n_split_types = 0, n_split_mz = 0;
 enum {
 NEVER, NO, YES
 } skip = NEVER, write_csv = NO;
 
+// Global run state accumulated over processed scans
+outfile *outfiles = NULL;
+int n_outfiles = 0;
+unsigned int *type_seen = NULL; // Scans seen so far of each kept scanType
+peak_heap highest;
+run_summary stats = {.low_t = DBL_MAX, .high_t = -DBL_MAX, .low_mz = DBL_MAX, .high_mz = -DBL_MAX};
+FILE *summary_file = NULL;
+FILE *info = NULL; // Verbose output, kept off stdout when the summary goes there
+scan_filter filter;
+bool windowed = false; // Loading scans through the index, so msRun stays open
+mxml_node_t **pending = NULL; // Closed nodes not yet written in streaming mode
+int n_pending = 0, max_pending = 1, pending_size = 0;
+double *lock_t = NULL, *lock_factor = NULL; // m/z drift correction at calibration scans
+int n_lock = 0, lock_size = 0;
+double lock_ready_t = -DBL_MAX; // retentionTime of the last point on the drift curve
+unsigned long lock_unready = 0; // Scans streamed out before the drift curve reached them
+scan_window *windows = NULL; // For each kept scanType, and parity if split
+int n_windows = 0, window_k = 0; // Scans either side that smoothing and persistence need
+unsigned long persist_peaks = 0, persist_removed = 0; // Peaks checked, and those dropped
+double *smooth_c = NULL; // Savitzky-Golay coefficients of scans -smooth_k..smooth_k
+double smooth_gap = 0; // TOF grid step in sqrt(m/z), once found
+unsigned long smoothed = 0; // Scans smoothed
+float *noise_I = NULL; // Scratch intensities for noise_floor
+long noise_size = 0;
+
 int main(int argc, char** argv) {
 	mxml_node_t *tree = NULL, *node = NULL;
-	const char *low_t_str = NULL, *high_t_str = NULL;
-	double low_t = DBL_MAX, high_t = 0;
-	peak *highest;
+	mzXML_reader *reader = NULL;
 
 	parse_command_line(argc, argv);
 
+	if (n_highest > 0) heap_init(&highest, n_highest);
+
+	// Start peak decoding threads, and let enough nodes wait when streaming
+	// for the threads to keep busy while the parser reads ahead
+	if (mzXML_set_threads(n_threads)) {
+		fprintf(stderr,"Could not start %d decode threads\n",n_threads);
+		exit(10);
+	}
+	if (centroid) mzXML_set_decode_hook(centroid_peaks);
+	if (n_threads > 0) max_pending = PENDING_PER_THREAD * n_threads;
+	pending_size = max_pending;
+	pending = malloc(pending_size * sizeof(mxml_node_t *));
+
+	// Start a writer thread for each outfile when streaming mzXML
+	if (streaming && write_csv == NO) {
+		for (int i = 0; i < n_outfiles; ++i) {
+			if (pool_init(&outfiles[i].writer,1)) {
+				fprintf(stderr,"Could not start writer thread for %s\n",outfiles[i].name);
+				exit(10);
+			}
+		}
+	}
+
 	// Load relevant parts of XML tree using SAX
-	if (verbose) printf("Parsing input mzXML\n");
+	// In streaming mode, sax_cb processes, writes and frees each scan
+	// A scan number or time window is read straight from the scan index
 	mxmlSetCustomHandlers(mzXML_load_custom,mzXML_save_custom);
-	tree = mxmlSAXLoadFile(NULL,input,mzXML_load_cb,sax_cb,NULL);
+	if (min_num > 0 || max_num < UINT_MAX || min_t > 0 || max_t < DBL_MAX)
+		reader = mzXML_open(inputname);
+	if (reader) {
+		if (verbose) fprintf(info,"Reading scan window through index of %ld scans\n",reader->n);
+		tree = load_window(reader);
+		mzXML_close(reader);
+	}
+	if (!tree) {
+		if (verbose) fprintf(info,"Parsing input mzXML\n");
+		tree = mxmlSAXLoadFile(NULL,input,mzXML_load_cb,sax_cb,NULL);
+	}
 	fclose(input);
-	if (verbose) printf("Parsing done\n");
+	if (verbose) fprintf(info,"Parsing done\n");
+	if (streaming) flush_pending(-1);
+	else {
+		if (window_k > 0) filter_tree(tree);
+		process_scans(&outfiles[0], tree);
+	}
 
-	// Allocate array for n-highest peaks, plus one extra for additions
-	if (n_highest > 0) highest = calloc(n_highest + 1, sizeof(peak));
+	if (verbose) fprintf(info,"\nProcessing done\n\n");
+	if (verbose && lock_mz > 0) {
+		if (n_lock > 0) {
+			double low = DBL_MAX, high = -DBL_MAX;
+			for (int i = 0; i < n_lock; ++i) {
+				double ppm = (1 / lock_factor[i] - 1) * 1E6;
+				if (ppm < low) low = ppm;
+				if (ppm > high) high = ppm;
+			}
+			fprintf(info,"Lock mass found in %d calibration scans, drift %.1f to %.1f ppm\n", n_lock, low, high);
+		} else fprintf(info,"Lock mass not found in any calibration scan, m/z left as is\n");
+	}
+	if (lock_unready > 0)
+		fprintf(stderr,"Warning: %lu scans were more than %d scans before the next calibration scan,\n"
+			"so their m/z drift was held level from the last one instead of interpolated\n",
+			lock_unready, HOLD_MAX);
+	if (verbose && smooth_k > 0)
+		fprintf(info,"Smoothed intensities of %lu scans along RT\n", smoothed);
+	if (verbose && persist_k > 0)
+		fprintf(info,"Persistence filter dropped %lu of %lu peaks (%.1f%%)\n", persist_removed, persist_peaks,
+			persist_peaks ? 100.0 * persist_removed / persist_peaks : 0);
+	if (verbose && noise_k > 0) {
+		for (int i = 0; i < n_outfiles; ++i) {
+			outfile *f = &outfiles[i];
+			fprintf(info,"Noise floor removed %lu of %lu peaks (%.1f%%)", f->noise_removed, f->noise_peaks,
+				f->noise_peaks ? 100.0 * f->noise_removed / f->noise_peaks : 0);
+			if (f->name) fprintf(info," from %s", f->name);
+			fprintf(info,"\n");
+		}
+		fprintf(info,"\n");
+	}
 
-	mxml_index_t *index = mxmlIndexNew(tree,"scan",NULL);
-	mxmlIndexReset(index);
-	while ((node = mxmlIndexEnum(index)) != NULL) {
-		mxml_node_t *peaksnode = mxmlFindElement(node, node, "peaks", NULL, NULL, MXML_DESCEND);
+	if (write_csv == NO) {
+		if (streaming) {
+			for (int i = 0; i < n_outfiles; ++i) {
+				outfile *f = &outfiles[i];
+				pool_destroy(&f->writer); // Finishes queued writes
+				patch_run_header(f);
+
+				// Hash the finished file, now that the totals are in place
+				if (f->sha1_open) {
+					if (mzXML_write_sha1(f->file)) {
+						fprintf(stderr,"Could not read back %s for its sha1\n",f->name);
+						exit(9);
+					}
+					fprintf(f->file,"</mzXML>\n");
+				}
+			}
+		} else {
+			// Correct scanCount, startTime and endTime values
+			node = mxmlFindElement(tree, tree, "msRun", NULL, NULL, MXML_DESCEND);
+			mxmlElementSetAttrf(node,"scanCount","%u",outfiles[0].scan_count);
+			mxmlElementSetAttr(node,"startTime",outfiles[0].low_t_str);
+			mxmlElementSetAttr(node,"endTime",outfiles[0].high_t_str);
+
+			// Write out mzXML with a new scan index
+			if (mzXML_save_file(tree, outfiles[0].file)) {
+				fprintf(stderr,"Could not write %s\n",outfiles[0].name);
+				exit(9);
+			}
+		}
+	}
 
-		if (verbose) printf("\rProcessing scan %s", mxmlElementGetAttr(node,"num"));
+	// Print out highest n peaks, or the run summary with them
+	if (n_highest > 0) qsort(highest.peaks, n_highest, sizeof(top_peak), compare_top_peak);
+	if (summary) {
+		write_summary(summary_file);
+		if (summary_file != stdout && fclose(summary_file)) {
+			fprintf(stderr,"Could not write summary\n");
+			exit(9);
+		}
+	} else if (n_highest > 0) {
+		top_peak *top = highest.peaks;
+		printf("%u highest peaks (num, RT, m/z, I)\n\n", n_highest);
+		for (int i = 0; i < n_highest; ++i) {
+			printf("%u %.3f %.3f %.3f\n", top[i].p.scan_num, top[i].p.RT, top[i].p.mz, top[i].p.I);
+		}
+	}
+	if (n_highest > 0) heap_free(&highest);
 
-		unsigned int peaks = strip_peaks(peaksnode); // Strip out unwanted peaks
-		if (n_highest > 0)
-			find_highest_peaks(peaksnode, highest); // Look for highest peaks
+	// Clean up
+	for (int i = 0; i < n_outfiles; ++i) {
+		if (outfiles[i].csv) csv_flush(&outfiles[i]);
+		free(outfiles[i].csv);
+		if (outfiles[i].file) fclose(outfiles[i].file);
+		free(outfiles[i].name);
+		free(outfiles[i].low_t_str);
+		free(outfiles[i].high_t_str);
+	}
+	mxmlDelete(tree);
+	mzXML_set_threads(0);
+	free(pending);
+	free(outfiles);
+	free(type_seen);
+	free(split_types);
+	free(scan_types);
+	free(split_mz);
+	free(noise_I);
+	free(lock_t);
+	free(lock_factor);
+	for (int i = 0; i < n_windows; ++i) {
+		for (int j = 0; j < windows[i].count; ++j) free(windows[i].peaks[j]);
+		free(windows[i].peaks);
+		free(windows[i].n);
+	}
+	free(windows);
+	free(smooth_c);
+	for (int i = 0; i < stats.n_types; ++i) free(stats.type_names[i]);
+	free(stats.type_names);
+	free(stats.type_counts);
+	free(stats.type_odd);
+	free(stats.type_even);
+	free(stats.tic);
+	return 0;
+}
 
-		if (write_csv == NO) {
-			if (compress_peaks)
-				mxmlElementSetAttr(peaksnode,"compressionType","zlib");
-			else mxmlElementSetAttr(peaksnode,"compressionType","none");
+// Load only the header and the scans in the -n/-N/-t/-T window, seeking to
+// them through the scan index, or return NULL to parse the whole file
+// sax_cb sees the same events as for the whole file, minus other scans.
+// Scan numbers and retention times must increase through the file.
+mxml_node_t *load_window(mzXML_reader *reader) {
+	char *header = mzXML_read_header(reader), *text;
+	mxml_node_t *tree, *run, *tag;
+	long first = 0, loaded_end = 0, length;
 
-			mxmlElementSetAttrf(node,"peaksCount","%u",peaks);
+	if (!header || !strstr(header,"<msRun")) {
+		free(header);
+		return NULL;
+	}
+	windowed = true;
+	tree = mxmlSAXLoadString(NULL,header,mzXML_load_cb,sax_cb,NULL);
+	free(header);
+	run = mxmlFindElement(tree, tree, "msRun", NULL, NULL, MXML_DESCEND);
 
-			// Delete base peak information
-			mxmlElementDeleteAttr(node,"basePeakMz");
-			mxmlElementDeleteAttr(node,"basePeakIntensity");
+	if (min_num > 0) first = mzXML_find_num(reader, min_num);
+	if (min_t > 0) {
+		long t_first = mzXML_find_time(reader, min_t);
+		if (t_first > first) first = t_first;
+	}
 
-			// Update lowest and highest retentionTime
-			double t = xsduration_to_s(mxmlElementGetAttr(node,"retentionTime"));
-			if (t < low_t) {
-				low_t = t;
-				low_t_str = mxmlElementGetAttr(node,"retentionTime");
-			}
-			if (t > high_t) {
-				high_t = t;
-				high_t_str = mxmlElementGetAttr(node,"retentionTime");
-			}
+	// Scans before the window still toggle -p and count for --split parity
+	if (skip != NEVER || split_parity) {
+		for (long i = 0; i < first; ++i) {
+			if ((tag = mzXML_read_tag(reader, i))) select_scan(tag);
+			mxmlDelete(tag);
 		}
 	}
 
-	if (verbose) printf("\nProcessing done\n\n");
+	for (long i = first; i < reader->n; ++i) {
+		if (reader->offsets[i] < loaded_end) continue; // Nested in the last scan
+
+		// Stop after the last scan in the window
+		if (!(tag = mzXML_read_tag(reader, i))) break;
+		const char *t_str = mxmlElementGetAttr(tag,"retentionTime");
+		bool past = reader->nums[i] > max_num || (t_str && xsduration_to_s(t_str) > max_t);
+		mxmlDelete(tag);
+		if (past) break;
+
+		if (!(text = mzXML_read_text(reader, i, &length))) break;
+		mxmlSAXLoadString(run,text,mzXML_load_cb,sax_cb,NULL);
+		loaded_end = reader->offsets[i] + length;
+		free(text);
+	}
+
+	// Close msRun and mzXML as the parser would have
+	windowed = false;
+	if (streaming) {
+		stream_close(run);
+		stream_close(mxmlGetParent(run));
+	}
+	return tree;
+}
+
+// Index of a scanType among those kept, or -1 if it is not kept
+int scan_type_index(const char *type) {
+	for (int i = 0; i < filter.n_types; ++i)
+		if (!strcmp(type,filter.types[i])) return i;
+	return -1;
+}
+
+// Outfile type index of a kept scanType
+// Kept types share type 0 unless split by type.
+int outfile_type(int type) {
+	return filter.by_type ? type : 0;
+}
+
+// Whether a node with the route noted by sax_cb goes to an outfile
+// Nodes other than scans have no route and go to every outfile
+bool routes_to(outfile *f, intptr_t route) {
+	if (route == 0) return true;
+	if (route < 0) return false;
+	return f->type == outfile_type((route - 1) / 2) && (f->parity < 0 || f->parity == (route - 1) % 2);
+}
+
+// Smoothing and persistence window of an accepted scan's route
+// Each kept scanType has its own, even when types share an outfile, and so
+// do even and odd scans when split by parity.
+int window_index(intptr_t route) {
+	return split_parity ? route - 1 : (route - 1) / 2;
+}
+
+// Process every accepted scan in a subtree for an outfile
+void process_scans(outfile *f, mxml_node_t *node) {
+	mxml_index_t *index = mxmlIndexNew(node,"scan",NULL);
+	mxml_node_t *scan;
+
+	mxmlIndexReset(index);
+	while ((scan = mxmlIndexEnum(index)) != NULL) process_scan(f, scan);
+	mxmlIndexDelete(index);
+}
+
+// Renumber, strip and update a single accepted scan node
+void process_scan(outfile *f, mxml_node_t *node) {
+	mxml_node_t *peaksnode = mxmlFindElement(node, node, "peaks", NULL, NULL, MXML_DESCEND);
+
+	if (renumber_scans) mxmlElementSetAttrf(node,"num","%u",++f->num);
+	if (verbose) fprintf(info,"\rProcessing scan %s", mxmlElementGetAttr(node,"num"));
+	++f->scan_count;
+
+	unsigned int peaks = strip_peaks(f, peaksnode); // Strip out unwanted peaks
+	if (n_highest > 0)
+		find_highest_peaks(peaksnode, &highest); // Look for highest peaks
+	if (summary) summarise_scan(node, peaksnode);
 
 	if (write_csv == NO) {
-		// Set indexOffset to nil
-		node = mxmlFindElement(tree, tree, "indexOffset", NULL, NULL, MXML_DESCEND);
-		mxmlElementSetAttr(node,"xsi:nil","1");
-		mxmlDelete(mxmlGetFirstChild(node));
+		if (tof_peaks)
+			mxmlElementSetAttr(peaksnode,"compressionType","tof");
+		else if (compress_peaks)
+			mxmlElementSetAttr(peaksnode,"compressionType","zlib");
+		else mxmlElementSetAttr(peaksnode,"compressionType","none");
 
-		// Correct scanCount, startTime and endTime values
-		node = mxmlFindElement(tree, tree, "msRun", NULL, NULL, MXML_DESCEND);
-		mxmlElementSetAttrf(node,"scanCount","%u",mxmlIndexGetCount(index));
-		mxmlElementSetAttr(node,"startTime",low_t_str);
-		mxmlElementSetAttr(node,"endTime",high_t_str);
+		mxmlElementSetAttrf(node,"peaksCount","%u",peaks);
 
-		// Write out mzXML
-		mxmlSetWrapMargin(0);
-		mxmlSaveFile(tree, output, mzXML_whitespace_cb);
+		// Delete base peak information
+		mxmlElementDeleteAttr(node,"basePeakMz");
+		mxmlElementDeleteAttr(node,"basePeakIntensity");
+
+		// Update lowest and highest retentionTime
+		// (copied, as the scan may be freed before totals are written)
+		const char *t_str = mxmlElementGetAttr(node,"retentionTime");
+		double t = xsduration_to_s(t_str);
+		if (t < f->low_t) {
+			f->low_t = t;
+			free(f->low_t_str);
+			f->low_t_str = strdup(t_str);
+		}
+		if (t > f->high_t) {
+			f->high_t = t;
+			free(f->high_t_str);
+			f->high_t_str = strdup(t_str);
+		}
 	}
+}
 
-	// Print out highest n peaks
-	if (n_highest > 0) {
-		printf("%u highest peaks (num, RT, m/z, I)\n\n", n_highest);
-		for (int i = 0; i < n_highest; ++i) {
-			printf("%u %.3f %.3f %.3f\n", highest[i].scan_num, highest[i].RT, highest[i].mz, highest[i].I);
+// Queue a copy of a node without its children to every outfile
+void write_all(int what, mxml_node_t *node) {
+	for (int i = 0; i < n_outfiles; ++i) write_to(&outfiles[i], what, mzXML_clone(node,0));
+}
+
+// Queue a detached node for the writer thread of an outfile, which frees it
+// Waits for the oldest queued node to be written if the queue is full
+void write_to(outfile *f, int what, mxml_node_t *node) {
+	write_job *job = &f->jobs[f->next_job];
+
+	f->next_job = (f->next_job + 1) % WRITE_QUEUE;
+	if (job->used) pool_wait(&f->writer, &job->task);
+	job->out = f;
+	job->what = what;
+	job->node = node;
+	job->used = true;
+	pool_submit(&f->writer, &job->task, write_job_cb, job);
+}
+
+// Write out and free a queued node on the writer thread of its outfile
+void write_job_cb(void *arg) {
+	write_job *job = arg;
+	FILE *file = job->out->file;
+	const char *name = mxmlGetElement(job->node);
+
+	switch (job->what) {
+		case W_NODE:
+			mzXML_write_node_indexed(job->node,file,&job->out->index);
+			break;
+		case W_OPEN:
+			fprintf(file,"<%s",name);
+			mzXML_write_attrs(job->node,file);
+			fprintf(file,">\n");
+			break;
+		case W_RUN:
+			write_run_header(job->out,job->node);
+			break;
+		case W_CLOSE:
+			// mzXML ends with the index, and is finished once hashed
+			if (!strcmp(name,"mzXML")) {
+				mzXML_write_index(&job->out->index,file);
+				job->out->sha1_open = true;
+			} else fprintf(file,"</%s>\n",name);
+			break;
+		default:
+			exit( 129 ); // Should NEVER get here!
+	}
+	mxmlDelete(job->node);
+}
+
+// Write msRun start tag in streaming mode, reserving space for the totals
+void write_run_header(outfile *f, mxml_node_t *node) {
+	mxmlElementDeleteAttr(node,"scanCount");
+	mxmlElementDeleteAttr(node,"startTime");
+	mxmlElementDeleteAttr(node,"endTime");
+
+	fprintf(f->file,"<%s",mxmlGetElement(node));
+	mzXML_write_attrs(node,f->file);
+	f->header_pos = ftell(f->file);
+	fprintf(f->file,"%*s>\n",HEADER_PAD,"");
+}
+
+// Fill in scanCount, startTime and endTime reserved by write_run_header
+void patch_run_header(outfile *f) {
+	char totals[HEADER_PAD + 1];
+	int length;
+
+	length = snprintf(totals,sizeof(totals)," scanCount=\"%u\" startTime=\"%s\" endTime=\"%s\"",
+		f->scan_count, f->low_t_str ? f->low_t_str : "PT0S", f->high_t_str ? f->high_t_str : "PT0S");
+	if (length > HEADER_PAD) {
+		fprintf(stderr,"msRun totals too long to patch in %s\n",f->name);
+		exit(9);
+	}
+	if (f->header_pos < 0 || fseek(f->file,f->header_pos,SEEK_SET) ||
+		fwrite(totals,1,length,f->file) != length) {
+		fprintf(stderr,"Could not patch msRun totals in %s (not seekable?)\n",f->name);
+		exit(9);
+	}
+	fseek(f->file,0,SEEK_END);
+}
+
+// Handle a closing tag in streaming mode
+// Accepted children of msRun and mzXML are queued, then processed, written
+// out and freed in order once the queue is full
+void stream_close(mxml_node_t *node) {
+	int id = element_id(mxmlGetElement(node)), parent_id;
+
+	if (id == E_MSRUN || id == E_MZXML) {
+		flush_pending(-1);
+		if (write_csv == NO) write_all(W_CLOSE,node);
+		return;
+	}
+	if (mxmlGetRefCount(node) < 2) return;
+	parent_id = element_id(mxmlGetElement(mxmlGetParent(node)));
+	if (parent_id != E_MSRUN && parent_id != E_MZXML) return;
+
+	flush_pending(max_pending - 1);
+	if (n_pending == pending_size) {
+		pending_size *= 2;
+		pending = realloc(pending, pending_size * sizeof(mxml_node_t *));
+	}
+	pending[n_pending++] = node;
+}
+
+// Finish queued nodes in order until at most keep are left, or all of them
+// once keep is -1 at the end of the run
+// Until then, scans are also left (up to HOLD_MAX) until the lock mass
+// drift curve reaches them, and until window_k later scans of their window
+// are queued for smoothing and the persistence filter.
+void flush_pending(int keep) {
+	bool final = keep < 0;
+
+	if (final) keep = 0;
+	else if (lock_mz > 0 || window_k > 0) {
+		int ready = n_pending, later[n_windows > 0 ? n_windows : 1];
+
+		// Count later scans of each window from the back
+		memset(later, 0, sizeof(later));
+		for (int i = n_pending - 1; i >= 0; --i) {
+			intptr_t route = (intptr_t)mxmlGetUserData(pending[i]);
+			bool held = lock_mz > 0 && !lock_ready(pending[i]);
+			if (window_k > 0 && route > 0) held |= later[window_index(route)]++ < window_k;
+			if (held) ready = i;
 		}
-		free(highest);
+		if (n_pending - ready > keep && n_pending - ready < HOLD_MAX) keep = n_pending - ready;
 	}
+	int done = n_pending - keep;
 
-	// Clean up
-	if (output) fclose(output);
-	mxmlIndexDelete(index);
-	mxmlDelete(tree);
-	return 0;
+	if (done <= 0) return;
+	for (int i = 0; i < done; ++i) {
+		// HOLD_MAX is reached, so drift is held level from the last
+		// calibration scan rather than interpolated to the next
+		if (lock_mz > 0 && !final && !lock_ready(pending[i])) ++lock_unready;
+		if (window_k > 0) filter_scan(pending[i], pending + i + 1, n_pending - i - 1);
+		finish_node(pending[i]);
+	}
+	memmove(pending, pending + done, keep * sizeof(mxml_node_t *));
+	n_pending = keep;
+}
+
+// Process a closed node in streaming mode for each outfile it is routed to,
+// and hand it to their writer threads or free it
+// The last outfile takes the node itself and the others each take a copy
+void finish_node(mxml_node_t *node) {
+	intptr_t route = (intptr_t)mxmlGetUserData(node);
+	outfile *last = NULL;
+
+	for (int i = 0; i < n_outfiles; ++i)
+		if (routes_to(&outfiles[i],route)) last = &outfiles[i];
+	if (last && write_csv == NO) mxmlRemove(node);
+
+	for (int i = 0; i < n_outfiles; ++i) {
+		outfile *f = &outfiles[i];
+		if (!routes_to(f,route)) continue;
+
+		mxml_node_t *copy = (f == last) ? node : mzXML_clone(node,1);
+		process_scans(f, copy);
+		if (write_csv == NO) write_to(f,W_NODE,copy);
+		else if (copy != node) mxmlDelete(copy);
+	}
+
+	// Otherwise drop our reference, freeing the node since the parser has
+	// released it
+	if (!last || write_csv != NO) mxmlRelease(node);
 }
 
 // Parse and validate command line, store params and open files
 void parse_command_line(int argc, char** argv) {
+	static struct option long_options[] = {
+		{"split", required_argument, NULL, 'S'},
+		{"centroid", no_argument, NULL, 'C'},
+		{"summary", no_argument, NULL, 'J'},
+		{"tof", no_argument, NULL, 'O'},
+		{"ms-level", required_argument, NULL, 'L'},
+		{"polarity", required_argument, NULL, 'P'},
+		{"lock-mass", required_argument, NULL, 'K'},
+		{"persist", required_argument, NULL, 'W'},
+		{"smooth", required_argument, NULL, 'G'},
+		{NULL, 0, NULL, 0}
+	};
 	int opt;
 
-	while ((opt = getopt (argc, argv, "s:p:n:N:t:T:m:M:i:cxzrh:v")) != -1) {
+	n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt_long(argc, argv, "s:p:n:N:t:T:m:M:i:k:cxzrfj:h:v", long_options, NULL)) != -1) {
 		switch (opt) {
 			case 's':
-				scan_type = optarg;
+				scan_types = realloc(scan_types, (n_scan_types + 1) * sizeof(char *));
+				scan_types[n_scan_types++] = optarg;
 				break;
 			case 'p':
 				switch(optarg[0]) {
@@ -180,6 +783,9 @@ void parse_command_line(int argc, char** argv) {
 			case 'i':
 				min_I = atof(optarg);
 				break;
+			case 'k':
+				noise_k = atof(optarg);
+				break;
 			case 'c':
 				write_csv = YES;
 				break;
@@ -192,162 +798,602 @@ void parse_command_line(int argc, char** argv) {
 			case 'r':
 				renumber_scans = false;
 				break;
+			case 'f':
+				streaming = true;
+				break;
+			case 'j':
+				n_threads = atoi(optarg);
+				break;
 			case 'h':
 				n_highest = atoi(optarg);
 				break;
 			case 'v':
 				verbose = true;
 				break;
+			case 'S':
+				parse_split(optarg, argv);
+				break;
+			case 'C':
+				centroid = true;
+				break;
+			case 'J':
+				summary = true;
+				break;
+			case 'O':
+				tof_peaks = true;
+				break;
+			case 'L':
+				ms_level = atoi(optarg);
+				break;
+			case 'P':
+				if (strcmp(optarg,"+") && strcmp(optarg,"-")) usage(argv);
+				polarity = optarg[0];
+				break;
+			case 'K':
+			{
+				char *end;
+				lock_mz = strtod(optarg,&end);
+				if (*end == ',') lock_tolerance = atof(end + 1);
+				if (lock_mz <= 0 || lock_tolerance <= 0) usage(argv);
+				break;
+			}
+			case 'W':
+			{
+				char *end;
+				persist_k = strtol(optarg,&end,10);
+				if (*end == ',') persist_tolerance = atof(end + 1);
+				if (persist_k <= 0 || persist_tolerance <= 0) usage(argv);
+				break;
+			}
+			case 'G':
+				smooth_k = atoi(optarg);
+				if (smooth_k < MIN_SMOOTH_K) usage(argv);
+				break;
 			default:
 				break;
 		}
 	}
 
+	// Summary mode streams the file through without writing or renumbering
+	if (summary) {
+		if (split_parity || n_split_types > 0 || n_split_mz > 0) {
+			fprintf(stderr,"--summary cannot be used with --split\n");
+			usage(argv);
+		}
+		write_csv = NEVER;
+		streaming = true;
+		renumber_scans = false;
+		if (n_highest == 0) n_highest = SUMMARY_TOP;
+	}
+
 	if (optind < argc) {
 		inputname = argv[optind];
 		input = openfile(inputname,"r");
 	} else usage(argv);
 	if (write_csv != NEVER) {
-		if (++optind < argc) {
-			outputname = argv[optind];
-			output = openfile(outputname,"w");
-		} else usage(argv);
+		if (++optind < argc) outputname = argv[optind];
+		else usage(argv);
+	} else if (summary) {
+		if (++optind < argc) summary_file = openfile(argv[optind],"w");
+		else summary_file = stdout;
 	}
+	info = summary_file == stdout ? stderr : stdout;
+	if (split_parity && skip != NEVER) {
+		fprintf(stderr,"--split parity cannot be used with -p\n");
+		usage(argv);
+	}
+	compile_filter();
+	make_outfiles();
 
 	if (verbose) {
-		printf("Reading from %s\n", inputname);
-		printf("Keeping scans of \"%s\" type ",scan_type);
+		fprintf(info,"Reading from %s\n", inputname);
+		fprintf(info,"Keeping scans of ");
+		for (int i = 0; i < filter.n_types; ++i) fprintf(info,"%s\"%s\"", i ? ", " : "", filter.types[i]);
+		fprintf(info,filter.n_types > 1 ? " types " : " type ");
+		if (ms_level > 0) fprintf(info,"with msLevel %d ", ms_level);
+		if (polarity) fprintf(info,"%s polarity %c ", ms_level > 0 ? "and" : "with", polarity);
 		switch(skip) {
 			case NO:
-				printf("and odd scan numbers ");
+				fprintf(info,"and odd scan numbers ");
 				break;
 			case YES:
-				printf("and even scan numbers ");
+				fprintf(info,"and even scan numbers ");
 				break;
 			case NEVER:
-				printf("and all scan numbers ");
+				fprintf(info,"and all scan numbers ");
 				break;
 			default:
 				exit( 129 ); // Should NEVER get here!
 		}
 
-		if (min_num != 0 && max_num != UINT_MAX) printf("between %u and %u ", min_num, max_num);
-		else if (min_num != 0) printf ("above %u ", min_num);
-		else if (max_num != UINT_MAX) printf("below %u ", max_num);
+		if (min_num != 0 && max_num != UINT_MAX) fprintf(info,"between %u and %u ", min_num, max_num);
+		else if (min_num != 0) fprintf(info,"above %u ", min_num);
+		else if (max_num != UINT_MAX) fprintf(info,"below %u ", max_num);
 
-		if (min_t != 0 && max_t != DBL_MAX) printf("and %.3f < RT < %.3f", min_t, max_t);
-		else if (min_t != 0) printf ("and RT > %.3f", min_t);
-		else if (max_t != DBL_MAX) printf("and RT < %.3f", max_t);
-		printf("\n");
+		if (min_t != 0 && max_t != DBL_MAX) fprintf(info,"and %.3f < RT < %.3f", min_t, max_t);
+		else if (min_t != 0) fprintf(info,"and RT > %.3f", min_t);
+		else if (max_t != DBL_MAX) fprintf(info,"and RT < %.3f", max_t);
+		fprintf(info,"\n");
 
-		if (min_t != 0 || max_t != DBL_MAX || min_mz != 0 || max_mz != DBL_MAX || min_I != 0) {
-			printf("Keeping peaks with ");
+		if (min_t != 0 || max_t != DBL_MAX || min_mz != 0 || max_mz != DBL_MAX || min_I != 0 || noise_k > 0) {
+			fprintf(info,"Keeping peaks with ");
 
-			if (min_mz != 0 && max_mz != DBL_MAX) printf("%.3f < m/z < %.3f ", min_mz, max_mz);
-			else if (min_mz != 0) printf ("m/z > %.3f ", min_mz);
-			else printf("m/z < %.3f ", max_mz);
+			if (min_mz != 0 && max_mz != DBL_MAX) fprintf(info,"%.3f < m/z < %.3f ", min_mz, max_mz);
+			else if (min_mz != 0) fprintf(info,"m/z > %.3f ", min_mz);
+			else fprintf(info,"m/z < %.3f ", max_mz);
 
-			if (min_I != 0) printf("I > %.3f", min_I);
-			printf("\n");
-		} else printf("Keeping all peaks\n");
+			if (min_I != 0) fprintf(info,"I > %.3f ", min_I);
+			if (noise_k > 0) fprintf(info,"I > median + %.3f sigma of scan", noise_k);
+			fprintf(info,"\n");
+		} else fprintf(info,"Keeping all peaks\n");
 
 		switch(write_csv) {
 			case NO:
-				if (compress_peaks) printf("Writing compressed mzXML to %s\n", outputname);
-				else printf("Writing uncompressed mzXML to %s\n", outputname);
+				for (int i = 0; i < n_outfiles; ++i) {
+					if (tof_peaks) fprintf(info,"Writing TOF coded mzXML to %s\n", outfiles[i].name);
+					else if (compress_peaks) fprintf(info,"Writing compressed mzXML to %s\n", outfiles[i].name);
+					else fprintf(info,"Writing uncompressed mzXML to %s\n", outfiles[i].name);
+				}
 				break;
 			case YES:
-				printf("Writing CSV to %s\n", outputname);
+				for (int i = 0; i < n_outfiles; ++i) fprintf(info,"Writing CSV to %s\n", outfiles[i].name);
 				break;
 			case NEVER:
-				printf("Writing nothing\n");
+				if (summary) fprintf(info,"Writing JSON run summary\n");
+				else fprintf(info,"Writing nothing\n");
 				break;
 			default:
 				exit( 129 ); // Should NEVER get here!
 		}
 
-		if (n_highest > 0) printf("Printing %u highest peaks\n", n_highest);
-		printf("\n");
+		if (centroid) fprintf(info,"Centroiding profile peaks\n");
+		if (smooth_k > 0) fprintf(info,"Smoothing intensities along RT over %d scans\n", 2 * smooth_k + 1);
+		if (persist_k > 0) fprintf(info,"Dropping peaks with no other within %.3f m/z in %d scans either side\n",
+			persist_tolerance, persist_k);
+		if (lock_mz > 0) fprintf(info,"Recalibrating m/z to lock mass %.4f +- %.4f in \"%s\" scans\n",
+			lock_mz, lock_tolerance, LOCK_SCAN_TYPE);
+		if (split_parity) fprintf(info,"Splitting even and odd scans\n");
+		if (n_split_mz > 0) fprintf(info,"Splitting peaks into %d m/z blocks\n", n_split_mz + 1);
+		if (streaming) fprintf(info,"Streaming scans to output as they are read\n");
+		if (n_threads > 0) fprintf(info,"Decoding peaks on %d threads\n", n_threads);
+		if (n_highest > 0) fprintf(info,"Printing %u highest peaks\n", n_highest);
+		fprintf(info,"\n");
+	}
+}
+
+// Parse a --split argument: parity, type:<scanType,...> or mz:<m/z,...>
+// Splits combine, giving an outfile for each combination
+void parse_split(char *arg, char **argv) {
+	char *item;
+
+	if (!strcmp(arg,"parity")) {
+		split_parity = true;
+	} else if (!strncmp(arg,"type:",5)) {
+		for (item = strtok(arg + 5,","); item; item = strtok(NULL,",")) {
+			split_types = realloc(split_types, (n_split_types + 1) * sizeof(char *));
+			split_types[n_split_types++] = item;
+		}
+	} else if (!strncmp(arg,"mz:",3)) {
+		for (item = strtok(arg + 3,","); item; item = strtok(NULL,",")) {
+			split_mz = realloc(split_mz, (n_split_mz + 1) * sizeof(double));
+			split_mz[n_split_mz] = atof(item);
+			if (n_split_mz > 0 && split_mz[n_split_mz] <= split_mz[n_split_mz - 1]) {
+				fprintf(stderr,"--split mz edges must increase\n");
+				usage(argv);
+			}
+			++n_split_mz;
+		}
+	} else usage(argv);
+
+	// Splitting writes scans to all outfiles as they are read
+	streaming = true;
+}
+
+// Set up an outfile for each combination of split scanType, parity and
+// m/z block, named outname.<scanType>.<even/odd>.<block>
+void make_outfiles(void) {
+	int n_types = n_split_types ? n_split_types : 1;
+	int n_parities = split_parity ? 2 : 1;
+	int n_blocks = n_split_mz + 1;
+
+	type_seen = calloc(n_types, sizeof(unsigned int));
+	window_k = smooth_k > persist_k ? smooth_k : persist_k;
+	if (window_k > 0) {
+		n_windows = filter.n_types * n_parities;
+		windows = calloc(n_windows, sizeof(scan_window));
+		for (int i = 0; i < n_windows; ++i) {
+			windows[i].peaks = calloc(window_k, sizeof(mzI_64 *));
+			windows[i].n = calloc(window_k, sizeof(long));
+		}
+	}
+
+	// Quadratic Savitzky-Golay coefficients, from the closed form for a
+	// window of 2k + 1 evenly spaced points
+	if (smooth_k > 0) {
+		double k = smooth_k;
+		smooth_c = malloc((2 * smooth_k + 1) * sizeof(double));
+		for (int j = -smooth_k; j <= smooth_k; ++j)
+			smooth_c[smooth_k + j] = 3 * (3*k*k + 3*k - 1 - 5.0*j*j) / ((2*k - 1) * (2*k + 1) * (2*k + 3));
+	}
+	n_outfiles = n_types * n_parities * n_blocks;
+	outfiles = calloc(n_outfiles, sizeof(outfile));
+	for (int i = 0; i < n_outfiles; ++i) {
+		outfile *f = &outfiles[i];
+		int block = i % n_blocks, parity = i / n_blocks % n_parities;
+
+		f->type = i / (n_blocks * n_parities);
+		f->parity = split_parity ? parity : -1;
+		f->min_mz = block > 0 ? split_mz[block - 1] : min_mz;
+		f->max_mz = block < n_split_mz ? split_mz[block] : max_mz;
+		f->low_t = DBL_MAX;
+		f->header_pos = -1;
+		if (write_csv == NEVER) continue;
+
+		int length = strlen(outputname);
+		f->name = malloc(length + (n_split_types ? strlen(split_types[f->type]) : 0) + 16);
+		strcpy(f->name, outputname);
+		if (n_split_types) length += sprintf(f->name + length, ".%s", split_types[f->type]);
+		if (split_parity) length += sprintf(f->name + length, parity ? ".odd" : ".even");
+		if (n_split_mz) sprintf(f->name + length, ".%04d", block);
+		// mzXML is read back to compute its sha1
+		f->file = openfile(f->name,write_csv == NO ? "w+" : "w");
+		if (write_csv == YES) f->csv = malloc(CSV_BUFFER);
+	}
+}
+
+// Compile the scan selection options into filter
+void compile_filter(void) {
+	static const char *default_type = DEFAULT_SCAN_TYPE;
+
+	if (n_split_types > 0) {
+		filter.types = (const char **)split_types;
+		filter.n_types = n_split_types;
+		filter.by_type = true;
+	} else if (n_scan_types > 0) {
+		filter.types = scan_types;
+		filter.n_types = n_scan_types;
+	} else {
+		filter.types = &default_type;
+		filter.n_types = 1;
 	}
+	filter.ms_level = ms_level;
+	filter.polarity = polarity;
+	filter.check_num = min_num > 0 || max_num < UINT_MAX;
+	filter.check_t = min_t > 0 || max_t < DBL_MAX;
+	filter.min_num = min_num;
+	filter.max_num = max_num;
+	filter.min_t = min_t;
+	filter.max_t = max_t;
+}
+
+// Intern an element name as one of the E_ ids, so that callbacks compare
+// it once and then dispatch on the id
+int element_id(const char *name) {
+	if (!name) return E_OTHER;
+	switch (name[0]) {
+		case 'd':
+			if (!strcmp(name,"dataProcessing")) return E_DATAPROCESSING;
+			break;
+		case 'i':
+			if (!strcmp(name,"index") || !strcmp(name,"indexOffset")) return E_DROPPED;
+			break;
+		case 'm':
+			if (!strcmp(name,"msRun")) return E_MSRUN;
+			if (!strcmp(name,"mzXML")) return E_MZXML;
+			break;
+		case 'p':
+			if (!strcmp(name,"peaks")) return E_PEAKS;
+			break;
+		case 's':
+			if (!strcmp(name,"scan")) return E_SCAN;
+			if (!strcmp(name,"sha1")) return E_DROPPED;
+			break;
+		default:
+			break;
+	}
+	return E_OTHER;
 }
 
 // SAX callback function
 void sax_cb(mxml_node_t *node, mxml_sax_event_t event,void *data){
-	static int num = 0;
 	mxml_node_t *parent = mxmlGetParent(node);
 
 	if (event == MXML_SAX_ELEMENT_OPEN) {
-		char *name = (char *)mxmlGetElement(node);
-
-		// Do not retain optional trees
-		if (!strcmp(name, "sha1") || !strcmp(name, "index")) {
-			return;
-		} else if (!strcmp(name,"scan")) {
-			if (strcmp(mxmlElementGetAttr(node,"scanType"),scan_type)) {
-				// Reject scan node if wrong scanType, without toggling skip
-				return;
-			} else {
-				switch (skip) {
-				case YES:
-					// Reject scan node if skip == YES
-					skip = NO;
-					return;
-				case NO:
-					// Else reject next scan node unless never skipping
-					skip = YES;
-				case NEVER:
-				{
-					unsigned int scan_num = atoi(mxmlElementGetAttr(node,"num"));
-					double t = xsduration_to_s(mxmlElementGetAttr(node,"retentionTime"));
-					if (t < min_t || t > max_t || scan_num < min_num || scan_num > max_num) {
-						// Reject scan node if wrong retentionTime or scan_num
-						return;
-					} else {
-						// Renumber scan
-						if (renumber_scans) mxmlElementSetAttrf(node,"num","%u",++num);
-						// Accept scan node
-						mxmlRetain(node);
-					}
-					break;
+		int id = element_id(mxmlGetElement(node));
+		intptr_t route;
+
+		switch (id) {
+			case E_DROPPED:
+				// Do not retain optional trees, which are written afresh
+				break;
+			case E_SCAN:
+				if (summary) count_scan_type(mxmlElementGetAttr(node,"scanType"), mxmlElementGetAttr(node,"num"));
+				if ((route = select_scan(node))) {
+					// Accept scan node, noting its scanType and parity
+					// to route it to outfiles (renumbered per outfile)
+					mxmlSetUserData(node,(void *)route);
+					mxmlRetain(node);
+				} else if (lock_mz > 0 && is_lock_scan(node)) {
+					// Keep calibration scans until the lock mass is measured
+					mxmlSetUserData(node,(void *)LOCK_ONLY);
+					mxmlRetain(node);
 				}
-				default:
-					exit( 129 ); // Should NEVER get here!
+				break;
+			case E_PEAKS:
+				if (mxmlGetRefCount(parent) > 1) {
+					// Accept peak nodes only if parent scan node was accepted
+					mxmlRetain(node);
 				}
-			}
-		} else if (!strcmp(name,"peaks")) {
-			if (mxmlGetRefCount(parent) > 1) {
-				// Accept peak nodes only if parent scan node was accepted
+				break;
+			default:
 				mxmlRetain(node);
+				if (centroid && id == E_DATAPROCESSING)
+					mxmlElementSetAttr(node,"centroided","1");
+				if (streaming && write_csv == NO) {
+					// Write start tags of containers as they open
+					if (id == E_MSRUN) write_all(W_RUN,node);
+					else if (id == E_MZXML) write_all(W_OPEN,node);
+				}
+				break;
+		}
+	} else if (event == MXML_SAX_ELEMENT_CLOSE) {
+		int id = element_id(mxmlGetElement(node));
+		if (windowed && (id == E_MSRUN || id == E_MZXML)) return;
+		if (id == E_SCAN && lock_mz > 0 && mxmlGetRefCount(node) > 1 && is_lock_scan(node)) {
+			measure_lock(node);
+			if ((intptr_t)mxmlGetUserData(node) == LOCK_ONLY) {
+				// Drop it, leaving the parser's reference to free it
+				mxmlRemove(node);
+				mxmlRelease(node);
+				return;
 			}
-		} else {
-			mxmlRetain(node);
 		}
+		if (streaming) stream_close(node);
 	} else if (event == MXML_SAX_DIRECTIVE) {
 		mxmlRetain(node);
+		if (streaming && write_csv == NO) write_all(W_NODE,node);
 	} else if (event == MXML_SAX_DATA) {
 		if (mxmlGetRefCount(parent) > 1) {
-			if (!strcmp(mxmlGetElement(parent),"peaks")) {
+			if (element_id(mxmlGetElement(parent)) == E_PEAKS) {
 				// Only accept data nodes if they are children of peak nodes
 				// This may be incorrect for certain separation schemas
 				// TODO: Correct this to take above into account
+				// Only peaks of accepted scans are ever decoded
 				mxmlRetain(node);
+				mzXML_decode_ahead(node);
 			}
 		}
 	}
 }
 
+// Decide whether to keep a scan by filter, toggling skip and counting parity
+// as each scan of a kept type, msLevel and polarity goes by
+// Returns its route to outfiles, or 0 to reject it
+intptr_t select_scan(mxml_node_t *node) {
+	const char *type_str = NULL, *num_str = NULL, *t_str = NULL;
+	const char *level_str = NULL, *polarity_str = NULL;
+
+	// Pick out the attributes tested in one pass, by first letter
+	for (int i = 0; i < node->value.element.num_attrs; ++i) {
+		mxml_attr_t *attr = &node->value.element.attrs[i];
+		switch (attr->name[0]) {
+			case 's':
+				if (!strcmp(attr->name,"scanType")) type_str = attr->value;
+				break;
+			case 'n':
+				if (!strcmp(attr->name,"num")) num_str = attr->value;
+				break;
+			case 'r':
+				if (!strcmp(attr->name,"retentionTime")) t_str = attr->value;
+				break;
+			case 'm':
+				if (!strcmp(attr->name,"msLevel")) level_str = attr->value;
+				break;
+			case 'p':
+				if (!strcmp(attr->name,"polarity")) polarity_str = attr->value;
+				break;
+			default:
+				break;
+		}
+	}
+
+	// Reject scan node if wrong scanType, msLevel or polarity, without
+	// toggling skip
+	int type = type_str ? scan_type_index(type_str) : -1;
+	if (type < 0) return 0;
+	if (filter.ms_level && (!level_str || atoi(level_str) != filter.ms_level)) return 0;
+	if (filter.polarity && (!polarity_str || polarity_str[0] != filter.polarity)) return 0;
+	int parity = ++type_seen[outfile_type(type)] % 2; // 1 for odd, 0 for even
+
+	switch (skip) {
+	case YES:
+		// Reject scan node if skip == YES
+		skip = NO;
+		return 0;
+	case NO:
+		// Else reject next scan node unless never skipping
+		skip = YES;
+	case NEVER:
+	{
+		// Reject scan node if wrong scan_num or retentionTime, only parsing
+		// them if limited
+		if (filter.check_num) {
+			unsigned int scan_num = num_str ? atoi(num_str) : 0;
+			if (scan_num < filter.min_num || scan_num > filter.max_num) return 0;
+		}
+		if (filter.check_t) {
+			double t = t_str ? xsduration_to_s(t_str) : 0;
+			if (t < filter.min_t || t > filter.max_t) return 0;
+		}
+		return 1 + 2 * type + parity;
+	}
+	default:
+		exit( 129 ); // Should NEVER get here!
+	}
+}
+
+// Count a scan of scanType type in the summary, whether kept or not, and by
+// the parity of its num if it has one
+void count_scan_type(const char *type, const char *num_str) {
+	int i;
+
+	if (!type) type = "";
+	for (i = 0; i < stats.n_types; ++i) if (!strcmp(stats.type_names[i], type)) break;
+	if (i == stats.n_types) {
+		stats.type_names = realloc(stats.type_names, (i + 1) * sizeof(char *));
+		stats.type_counts = realloc(stats.type_counts, (i + 1) * sizeof(unsigned long));
+		stats.type_odd = realloc(stats.type_odd, (i + 1) * sizeof(unsigned long));
+		stats.type_even = realloc(stats.type_even, (i + 1) * sizeof(unsigned long));
+		stats.type_names[i] = strdup(type);
+		stats.type_counts[i] = stats.type_odd[i] = stats.type_even[i] = 0;
+		++stats.n_types;
+	}
+	++stats.type_counts[i];
+	if (num_str) {
+		if (strtoul(num_str, NULL, 10) % 2) ++stats.type_odd[i];
+		else ++stats.type_even[i];
+	}
+}
+
+// Add a kept scan, with its peaks as stripped, to the summary
+void summarise_scan(mxml_node_t *node, mxml_node_t *peaksnode) {
+	long length;
+	void *data = mzXML_get_peaks(peaksnode,&length);
+	int size = atoi(mxmlElementGetAttr(peaksnode,"precision"))/8;
+	long n = length/(2*size);
+	double t = xsduration_to_s(mxmlElementGetAttr(node,"retentionTime")), tic = 0;
+
+	for (long i = 0; i < n; ++i) {
+		double mz, I;
+		if (4 == size) {
+			mz = ((mzI_32*)data)[i].mz;
+			I = ((mzI_32*)data)[i].I;
+		} else {
+			mz = ((mzI_64*)data)[i].mz;
+			I = ((mzI_64*)data)[i].I;
+		}
+		tic += I;
+		++stats.I_hist[log2_bin(I)];
+		if (mz < stats.low_mz) stats.low_mz = mz;
+		if (mz > stats.high_mz) stats.high_mz = mz;
+	}
+
+	if (stats.scans == stats.tic_size) {
+		stats.tic_size = stats.tic_size ? 2 * stats.tic_size : 1024;
+		stats.tic = realloc(stats.tic, stats.tic_size * sizeof(tic_point));
+	}
+	stats.tic[stats.scans].num = atoi(mxmlElementGetAttr(node,"num"));
+	stats.tic[stats.scans].RT = t;
+	stats.tic[stats.scans].I = tic;
+	++stats.scans;
+	stats.peaks += n;
+	stats.total_I += tic;
+	++stats.peaks_hist[log2_bin(n)];
+	if (t < stats.low_t) stats.low_t = t;
+	if (t > stats.high_t) stats.high_t = t;
+}
+
+// Histogram bin of x, with bin 0 for x < 1 and bin k for 2^(k-1) <= x < 2^k
+int log2_bin(double x) {
+	int e;
+
+	if (!(x >= 1)) return 0;
+	frexp(x, &e);
+	return e < HIST_BINS ? e : HIST_BINS - 1;
+}
+
+// Write the run summary as JSON
+void write_summary(FILE *fp) {
+	unsigned long scans = 0;
+
+	fprintf(fp,"{\n  \"file\": ");
+	write_json_string(fp, inputname);
+	for (int i = 0; i < stats.n_types; ++i) scans += stats.type_counts[i];
+	fprintf(fp,",\n  \"scans\": %lu,\n  \"scanTypes\": {", scans);
+	for (int i = 0; i < stats.n_types; ++i) {
+		fprintf(fp,"%s\n    ", i ? "," : "");
+		write_json_string(fp, stats.type_names[i]);
+		fprintf(fp,": {\"scans\": %lu, \"odd\": %lu, \"even\": %lu}",
+			stats.type_counts[i], stats.type_odd[i], stats.type_even[i]);
+	}
+	fprintf(fp,"\n  },\n");
+
+	fprintf(fp,"  \"keptScans\": %lu,\n  \"peaks\": %lu,\n  \"totalIntensity\": %.3f,\n",
+		stats.scans, stats.peaks, stats.total_I);
+	if (stats.scans > 0) fprintf(fp,"  \"RT\": [%.3f, %.3f],\n", stats.low_t, stats.high_t);
+	else fprintf(fp,"  \"RT\": null,\n");
+	if (stats.peaks > 0) fprintf(fp,"  \"mz\": [%.4f, %.4f],\n", stats.low_mz, stats.high_mz);
+	else fprintf(fp,"  \"mz\": null,\n");
+	write_histogram(fp, "peaksPerScan", stats.peaks_hist);
+	write_histogram(fp, "intensity", stats.I_hist);
+
+	fprintf(fp,"  \"TIC\": [");
+	for (long i = 0; i < stats.scans; ++i)
+		fprintf(fp,"%s\n    [%u, %.3f, %.3f]", i ? "," : "", stats.tic[i].num, stats.tic[i].RT, stats.tic[i].I);
+	fprintf(fp,"\n  ],\n");
+
+	// Placeholders are left at I = 0 if there were fewer peaks than asked for
+	fprintf(fp,"  \"highestPeaks\": [");
+	for (int i = 0, n = 0; i < n_highest; ++i) {
+		peak *p = &highest.peaks[i].p;
+		if (p->I <= 0) continue;
+		fprintf(fp,"%s\n    {\"num\": %u, \"RT\": %.3f, \"mz\": %.4f, \"I\": %.3f}",
+			n++ ? "," : "", p->scan_num, p->RT, p->mz, p->I);
+	}
+	fprintf(fp,"\n  ]\n}\n");
+}
+
+// Write a histogram as a JSON list of [from, to, count] up to its last
+// non-empty bin
+void write_histogram(FILE *fp, const char *name, unsigned long *hist) {
+	int last = HIST_BINS - 1;
+
+	while (last > 0 && hist[last] == 0) --last;
+	fprintf(fp,"  \"%sHistogram\": [", name);
+	for (int k = 0; k <= last; ++k)
+		fprintf(fp,"%s\n    [%.0f, %.0f, %lu]", k ? "," : "", k ? ldexp(1, k - 1) : 0, ldexp(1, k), hist[k]);
+	fprintf(fp,"\n  ],\n");
+}
+
+// Write s as a quoted JSON string
+void write_json_string(FILE *fp, const char *s) {
+	fputc('"', fp);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\') fprintf(fp,"\\%c", *s);
+		else if ((unsigned char)*s < 0x20) fprintf(fp,"\\u%04x", *s);
+		else fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
 // Removes unwanted peaks and returns number of remaining peaks
-unsigned int strip_peaks(mxml_node_t *peaksnode) {
+unsigned int strip_peaks(outfile *f, mxml_node_t *peaksnode) {
 	int scan_num = atoi(mxmlElementGetAttr(mxmlGetParent(peaksnode),"num"));
-	int length = atoi(mxmlElementGetAttr(peaksnode,"compressedLen"));
+	long length;
 	int peaks = 0;
 	int size = atoi(mxmlElementGetAttr(peaksnode,"precision"))/8;
 	assert(4 == size || 8 == size);
 
+	// Format the scan number and RT starting each CSV line once per scan
+	char prefix[CSV_LINE_MAX];
+	int prefix_length = 0;
+	double RT = 0, drift = 1;
+	if (write_csv == YES || lock_mz > 0)
+		RT = xsduration_to_s(mxmlElementGetAttr(mxmlGetParent(peaksnode),"retentionTime"));
+	if (lock_mz > 0) drift = drift_factor(RT);
+	if (write_csv == YES) {
+		prefix_length = sprintf(prefix,"%u ",scan_num);
+		prefix_length += format_fixed3(prefix + prefix_length, RT);
+		prefix[prefix_length++] = ' ';
+	}
+
 	void *new, *new_ptr, *old, *old_ptr;
-	old = old_ptr = (void *)mxmlGetCustom(peaksnode); // Old peak list and position to read from
+	old = old_ptr = mzXML_get_peaks(peaksnode,&length); // Old peak list and position to read from
 	new = new_ptr = malloc(length); // New peak list and position to write to
 
+	double noise = noise_k > 0 ? noise_floor(old, length/(2*size), size) : -DBL_MAX;
+	unsigned int removed = 0;
+
 	while(old_ptr-old < length) {
 		double mz, I;
 
@@ -358,17 +1404,38 @@ unsigned int strip_peaks(mxml_node_t *peaksnode) {
 			mz = (*(mzI_64*)old_ptr).mz;
 			I = (*(mzI_64*)old_ptr).I;
 		}
+		if (lock_mz > 0) {
+			// Correct m/z for drift, rounding as it is stored
+			if (4 == size) mz = (float)(mz * drift);
+			else mz *= drift;
+		}
+
+		bool in_range = I > min_I && mz > f->min_mz && mz < f->max_mz;
+		if (in_range && I <= noise) {
+			in_range = false;
+			++removed;
+		}
 
-		// Accept peak if mz and I are within range
-		if ( I > min_I && mz > min_mz && mz < max_mz) {
-			// Write peak to CSV
+		// Accept peak if mz and I are within range and above the noise floor
+		if (in_range) {
+			// Write peak to CSV as "num RT m/z I"
 			if (write_csv == YES) {
-				mxml_node_t *node = mxmlGetParent(peaksnode);
-				double RT = xsduration_to_s(mxmlElementGetAttr(node,"retentionTime"));
-				fprintf(output,"%u %.3f %.3f %.3f\n",scan_num,RT,mz,I);
+				if (f->csv_length + CSV_LINE_MAX > CSV_BUFFER) csv_flush(f);
+				char *line = f->csv + f->csv_length;
+				memcpy(line, prefix, prefix_length);
+				line += prefix_length;
+				line += format_fixed3(line, mz);
+				*line++ = ' ';
+				line += format_fixed3(line, I);
+				*line++ = '\n';
+				f->csv_length = line - f->csv;
 			}
 			// Copy peak to new peak list
 			memcpy(new_ptr, old_ptr, 2*size);
+			if (lock_mz > 0) {
+				if (4 == size) (*(mzI_32*)new_ptr).mz = mz;
+				else (*(mzI_64*)new_ptr).mz = mz;
+			}
 			new_ptr += 2*size;
 			++peaks;
 		}
@@ -377,20 +1444,414 @@ unsigned int strip_peaks(mxml_node_t *peaksnode) {
 
 	length = new_ptr-new;
 	assert(length == 2*size*peaks);
-	new = realloc(new,length);
-	mxmlElementSetAttrf(peaksnode,"compressedLen","%u",length);
-	mxmlSetCustom(peaksnode,new,mzXML_destroy_custom); // Handles freeing of new
+	new = realloc(new,length > 0 ? length : 1); // Empty lists stay allocated
+	mzXML_set_peaks(peaksnode,new,length); // Handles freeing of new
+
+	if (noise_k > 0) {
+		f->noise_peaks += peaks + removed;
+		f->noise_removed += removed;
+		if (verbose) fprintf(info,": noise floor %.3f removes %.1f%% of peaks\n", noise,
+			peaks + removed ? 100.0 * removed / (peaks + removed) : 0);
+	}
+
+	return peaks;
+}
+
+// Estimate the noise floor of a scan of n peaks as median + k sigma of their
+// intensities, taking sigma from the median absolute deviation so that the
+// few real peaks above the baseline do not inflate it
+double noise_floor(void *data, long n, int size) {
+	if (n == 0) return 0;
+	if (n > noise_size) {
+		noise_size = n;
+		noise_I = realloc(noise_I, n * sizeof(float));
+	}
+
+	// Gather intensities, then deviations, in loops the compiler vectorizes
+	if (4 == size) {
+		const mzI_32 *p = data;
+		for (long i = 0; i < n; ++i) noise_I[i] = p[i].I;
+	} else {
+		const mzI_64 *p = data;
+		for (long i = 0; i < n; ++i) noise_I[i] = p[i].I;
+	}
+	float median = select_nth(noise_I, n, n/2);
+	for (long i = 0; i < n; ++i) noise_I[i] = fabsf(noise_I[i] - median);
+	float mad = select_nth(noise_I, n, n/2);
+
+	return median + noise_k * MAD_TO_SIGMA * mad;
+}
+
+// Whether a scan is of the scanType carrying the lock mass
+bool is_lock_scan(mxml_node_t *node) {
+	const char *type = mxmlElementGetAttr(node,"scanType");
+	return type && !strcmp(type,LOCK_SCAN_TYPE);
+}
+
+// Find the lock mass in a calibration scan as the intensity weighted mean
+// m/z of its peaks within tolerance, and add the factor correcting it at
+// the scan's retentionTime to the drift curve
+void measure_lock(mxml_node_t *scan) {
+	mxml_node_t *peaksnode = mxmlFindElement(scan, scan, "peaks", NULL, NULL, MXML_DESCEND_FIRST);
+	const char *t_str = mxmlElementGetAttr(scan,"retentionTime");
+	double sum_I = 0, sum_mzI = 0, t;
+	long length;
+
+	if (!peaksnode || !t_str) return;
+	t = xsduration_to_s(t_str);
+
+	void *data = mzXML_get_peaks(peaksnode, &length);
+	int size = atoi(mxmlElementGetAttr(peaksnode,"precision"))/8;
+	for (long i = 0; i < length/(2*size); ++i) {
+		double mz = 4 == size ? ((mzI_32 *)data)[i].mz : ((mzI_64 *)data)[i].mz;
+		double I = 4 == size ? ((mzI_32 *)data)[i].I : ((mzI_64 *)data)[i].I;
+		if (fabs(mz - lock_mz) <= lock_tolerance && I > 0) {
+			sum_I += I;
+			sum_mzI += mz * I;
+		}
+	}
+	// Calibration scans must come in order of retentionTime
+	if (sum_I <= 0 || (n_lock > 0 && t <= lock_t[n_lock - 1])) return;
+
+	if (n_lock == lock_size) {
+		lock_size = lock_size ? 2 * lock_size : 256;
+		lock_t = realloc(lock_t, lock_size * sizeof(double));
+		lock_factor = realloc(lock_factor, lock_size * sizeof(double));
+	}
+	lock_t[n_lock] = t;
+	lock_factor[n_lock++] = lock_mz / (sum_mzI / sum_I);
+	lock_ready_t = t;
+}
+
+// m/z correction factor at retentionTime t, interpolated linearly between
+// calibration scans and held level beyond the first and last
+double drift_factor(double t) {
+	int low = 0, high = n_lock;
+
+	if (n_lock == 0) return 1;
+	if (t <= lock_t[0]) return lock_factor[0];
+	if (t >= lock_t[n_lock - 1]) return lock_factor[n_lock - 1];
+
+	// Find the first calibration scan after t
+	while (low < high) {
+		int mid = low + (high - low) / 2;
+		if (lock_t[mid] <= t) low = mid + 1;
+		else high = mid;
+	}
+	double w = (t - lock_t[low - 1]) / (lock_t[low] - lock_t[low - 1]);
+	return lock_factor[low - 1] + w * (lock_factor[low] - lock_factor[low - 1]);
+}
+
+// Whether a pending node can be finished, as the drift curve reaches it
+bool lock_ready(mxml_node_t *node) {
+	const char *t_str;
+
+	if (!mxmlGetUserData(node) || !(t_str = mxmlElementGetAttr(node,"retentionTime"))) return true;
+	return xsduration_to_s(t_str) <= lock_ready_t;
+}
+
+// Run smoothing and the persistence filter over every accepted scan of a
+// whole tree
+void filter_tree(mxml_node_t *tree) {
+	mxml_index_t *index = mxmlIndexNew(tree,"scan",NULL);
+	mxml_node_t **scans = malloc(mxmlIndexGetCount(index) * sizeof(mxml_node_t *)), *scan;
+	int n = 0;
+
+	mxmlIndexReset(index);
+	while ((scan = mxmlIndexEnum(index)) != NULL) scans[n++] = scan;
+	for (int i = 0; i < n; ++i) filter_scan(scans[i], scans + i + 1, n - i - 1);
+	mxmlIndexDelete(index);
+	free(scans);
+}
+
+// Smooth and filter an accepted scan against the last window_k scans of its
+// window (its scanType, and parity if split by parity) and the next window_k found among the n_later scans that follow it
+// Neighbours are unfiltered and sorted by m/z, with the scan j away at
+// near[window_k + j], or NULL past either end of the run. The scan is then
+// remembered, unfiltered, for those after it.
+void filter_scan(mxml_node_t *scan, mxml_node_t **later, int n_later) {
+	intptr_t route = (intptr_t)mxmlGetUserData(scan);
+	mxml_node_t *peaksnode = mxmlFindElement(scan, scan, "peaks", NULL, NULL, MXML_DESCEND_FIRST);
+	mzI_64 *near[2 * window_k + 1], *own;
+	long near_n[2 * window_k + 1], n_own;
+
+	if (route <= 0 || !peaksnode) return;
+	scan_window *w = &windows[window_index(route)];
+	own = sorted_peaks(scan, &n_own);
+
+	memset(near, 0, sizeof(near));
+	memset(near_n, 0, sizeof(near_n));
+	for (int j = 1; j <= w->count; ++j) {
+		int slot = (w->next - j + window_k) % window_k;
+		near[window_k - j] = w->peaks[slot];
+		near_n[window_k - j] = w->n[slot];
+	}
+	for (int i = 0, j = 1; i < n_later && j <= window_k; ++i) {
+		intptr_t later_route = (intptr_t)mxmlGetUserData(later[i]);
+		if (later_route <= 0 || window_index(later_route) != window_index(route)) continue;
+		near[window_k + j] = sorted_peaks(later[i], &near_n[window_k + j]);
+		++j;
+	}
+
+	if (smooth_k > 0) smooth_scan(peaksnode, near, near_n);
+	if (persist_k > 0) persist_scan(peaksnode, near, near_n);
+	for (int j = 1; j <= window_k; ++j) free(near[window_k + j]);
+
+	// Remember this scan in place of the oldest
+	if (w->count == window_k) free(w->peaks[w->next]);
+	else ++w->count;
+	w->peaks[w->next] = own;
+	w->n[w->next] = n_own;
+	w->next = (w->next + 1) % window_k;
+}
+
+// Smooth the intensities of a scan along RT with a quadratic Savitzky-Golay
+// filter over the smooth_k scans either side of it, each TOF bin on its own
+// A neighbour's peak is in the same bin if it is within half a grid step in
+// TOF. A bin missing from a neighbour counts as 0 there, and bins found only
+// in neighbours are not added. Scans without the whole window, at the ends of
+// the run, are left as they are. Each neighbour is gathered into a column
+// by the bins of this scan, then added in a loop the compiler vectorizes.
+void smooth_scan(mxml_node_t *peaksnode, mzI_64 **near, long *near_n) {
+	long length;
+	void *data = mzXML_get_peaks(peaksnode, &length);
+	int size = atoi(mxmlElementGetAttr(peaksnode,"precision"))/8;
+	long n = length/(2*size);
+
+	for (int j = 1; j <= smooth_k; ++j)
+		if (!near[window_k - j] || !near[window_k + j]) return;
+	if (n == 0) return;
+
+	// The grid step is taken from the first scan that has one
+	if (smooth_gap == 0 && (smooth_gap = tof_grid(data, n, 8*size)) == 0) return;
+
+	// Half a step in TOF is sqrt(m/z) * step in m/z
+	double *mz = malloc(4 * n * sizeof(double)), *half = mz + n, *sum = half + n, *column = sum + n;
+	for (long i = 0; i < n; ++i) {
+		mz[i] = 4 == size ? ((mzI_32 *)data)[i].mz : ((mzI_64 *)data)[i].mz;
+		half[i] = sqrt(mz[i]) * smooth_gap;
+		sum[i] = smooth_c[smooth_k] * (4 == size ? ((mzI_32 *)data)[i].I : ((mzI_64 *)data)[i].I);
+	}
+
+	for (int j = -smooth_k; j <= smooth_k; ++j) {
+		if (j == 0) continue;
+		const mzI_64 *p = near[window_k + j];
+		long m = near_n[window_k + j], pos = 0;
+		double c = smooth_c[smooth_k + j];
+
+		// Move back to the start of the neighbour whenever the scan steps
+		// down in m/z
+		for (long i = 0; i < n; ++i) {
+			if (i > 0 && mz[i] < mz[i-1]) pos = 0;
+			while (pos < m && p[pos].mz < mz[i] - half[i]) ++pos;
+			column[i] = pos < m && p[pos].mz <= mz[i] + half[i] ? p[pos].I : 0;
+		}
+		for (long i = 0; i < n; ++i) sum[i] += c * column[i];
+	}
+
+	// The negative side lobes of the filter can take I below 0
+	for (long i = 0; i < n; ++i) {
+		double I = sum[i] > 0 ? sum[i] : 0;
+		if (4 == size) ((mzI_32 *)data)[i].I = I;
+		else ((mzI_64 *)data)[i].I = I;
+	}
+	++smoothed;
+	free(mz);
+}
+
+// Drop the peaks of a scan with no peak within persist_tolerance m/z in the
+// persist_k scans either side of it
+// Each neighbour is sorted by m/z, so one sliding merge finds the peaks near
+// it, moving back to the start of each whenever the scan steps down in m/z.
+void persist_scan(mxml_node_t *peaksnode, mzI_64 **near, long *near_n) {
+	long length;
+	void *data = mzXML_get_peaks(peaksnode, &length);
+	int size = atoi(mxmlElementGetAttr(peaksnode,"precision"))/8;
+	long n = length/(2*size), kept = 0, pos[2 * window_k + 1];
+	void *new = malloc(length > 0 ? length : 1);
+	double last = -DBL_MAX;
+
+	memset(pos, 0, sizeof(pos));
+	for (long i = 0; i < n; ++i) {
+		double mz = 4 == size ? ((mzI_32 *)data)[i].mz : ((mzI_64 *)data)[i].mz;
+		bool found = false;
+
+		if (mz < last) memset(pos, 0, sizeof(pos));
+		last = mz;
+		for (int j = window_k - persist_k; j <= window_k + persist_k && !found; ++j) {
+			if (j == window_k || !near[j]) continue;
+			while (pos[j] < near_n[j] && near[j][pos[j]].mz < mz - persist_tolerance) ++pos[j];
+			found = pos[j] < near_n[j] && near[j][pos[j]].mz <= mz + persist_tolerance;
+		}
+		if (found) memcpy((char *)new + 2*size*kept++, (char *)data + 2*size*i, 2*size);
+	}
+	persist_peaks += n;
+	persist_removed += n - kept;
+	mzXML_set_peaks(peaksnode, realloc(new, kept > 0 ? 2*size*kept : 1), 2*size*kept);
+}
+
+// Peaks of a scan in double precision, sorted by m/z, for smoothing and the
+// persistence filter
+mzI_64 *sorted_peaks(mxml_node_t *scan, long *n) {
+	mxml_node_t *peaksnode = mxmlFindElement(scan, scan, "peaks", NULL, NULL, MXML_DESCEND_FIRST);
+	long length = 0;
+	void *data = peaksnode ? mzXML_get_peaks(peaksnode, &length) : NULL;
+	int size = peaksnode ? atoi(mxmlElementGetAttr(peaksnode,"precision"))/8 : 8;
+	bool sorted = true;
 
+	*n = data ? length/(2*size) : 0;
+	mzI_64 *peaks = malloc((*n > 0 ? *n : 1) * sizeof(mzI_64));
+	for (long i = 0; i < *n; ++i) {
+		peaks[i].mz = 4 == size ? ((mzI_32 *)data)[i].mz : ((mzI_64 *)data)[i].mz;
+		peaks[i].I = 4 == size ? ((mzI_32 *)data)[i].I : ((mzI_64 *)data)[i].I;
+		if (i > 0 && peaks[i].mz < peaks[i-1].mz) sorted = false;
+	}
+	if (!sorted) qsort(peaks, *n, sizeof(mzI_64), compare_mz);
 	return peaks;
 }
 
-// Updates the list of n-highest peaks (VERY QUICK AND DIRTY!)
-void find_highest_peaks(mxml_node_t *peaksnode, peak *highest) {
+int compare_mz(const void *a, const void *b) {
+	double mz_a = ((const mzI_64 *)a)->mz, mz_b = ((const mzI_64 *)b)->mz;
+
+	return (mz_a > mz_b) - (mz_a < mz_b);
+}
+
+// Reduce a decoded profile peak list to one centroid per peak, in place
+// Samples lie on a grid even in TOF, i.e. sqrt(m/z), so a peak runs up to
+// its apex and down again over adjacent grid points, ending at a valley or a
+// gap. Its apex is found by fitting a parabola in TOF to the highest sample
+// and its neighbours, and its intensity is the sum over the peak.
+// Runs on the decode pool with each scan, so touches only the peak list.
+void centroid_peaks(mzXML_peaks *peaks) {
+	int size = peaks->precision/8;
+	long n = peaks->length/(2*size), k = 0;
+	double *t = malloc(2 * n * sizeof(double)), *I = t + n;
+	double step = DBL_MAX;
+
+	for (long i = 0; i < n; ++i) {
+		if (4 == size) {
+			t[i] = sqrt(((mzI_32*)peaks->data)[i].mz);
+			I[i] = ((mzI_32*)peaks->data)[i].I;
+		} else {
+			t[i] = sqrt(((mzI_64*)peaks->data)[i].mz);
+			I[i] = ((mzI_64*)peaks->data)[i].I;
+		}
+		if (i > 0 && t[i] - t[i-1] > 0 && t[i] - t[i-1] < step) step = t[i] - t[i-1];
+	}
+	double max_gap = GRID_GAP * step;
+
+	for (long i = 0; i < n; ++i) {
+		long start = i, apex = i;
+		double sum = I[i];
+		bool falling = false;
+
+		// Take samples up to the next valley or gap, which ends the peak
+		while (i + 1 < n && t[i+1] - t[i] < max_gap) {
+			if (I[i+1] > I[i] && falling) break;
+			if (I[i+1] < I[i]) falling = true;
+			sum += I[++i];
+			if (I[i] > I[apex]) apex = i;
+		}
+		if (sum <= 0) continue;
+
+		double t_apex = t[apex];
+		if (apex > start && apex < i) {
+			double curve = I[apex-1] - 2*I[apex] + I[apex+1];
+			if (curve < 0) t_apex += 0.25 * (I[apex-1] - I[apex+1]) / curve * (t[apex+1] - t[apex-1]);
+		}
+
+		if (4 == size) {
+			((mzI_32*)peaks->data)[k].mz = t_apex * t_apex;
+			((mzI_32*)peaks->data)[k].I = sum;
+		} else {
+			((mzI_64*)peaks->data)[k].mz = t_apex * t_apex;
+			((mzI_64*)peaks->data)[k].I = sum;
+		}
+		++k;
+	}
+	free(t);
+
+	peaks->length = k * 2 * size;
+	if (k > 0) peaks->data = realloc(peaks->data, peaks->length);
+}
+
+// Partially sort a[0..n) in place by quickselect and return its k-th lowest
+float select_nth(float *a, long n, long k) {
+	long low = 0, high = n - 1;
+
+	while (low < high) {
+		float pivot = a[low + (high - low) / 2];
+		long i = low, j = high;
+		while (i <= j) {
+			while (a[i] < pivot) ++i;
+			while (a[j] > pivot) --j;
+			if (i <= j) {
+				float t = a[i];
+				a[i++] = a[j];
+				a[j--] = t;
+			}
+		}
+		if (k <= j) high = j;
+		else if (k >= i) low = i;
+		else break;
+	}
+	return a[k];
+}
+
+// Write x as printf's %.3f would, returning the length written
+// Usual values are formatted directly from x*1000 rounded. Values whose
+// rounding is close to a tie, negative or huge are left to sprintf, which
+// rounds the exact binary value.
+int format_fixed3(char *out, double x) {
+	double y = x * 1000;
+
+	if (!signbit(x) && y < 1E12) {
+		double whole = floor(y);
+		if (fabs(y - whole - 0.5) > 1E-3) {
+			uint64_t n = whole + (y - whole > 0.5);
+			uint64_t integer = n / 1000;
+			unsigned int thousandths = n % 1000;
+			char digits[20];
+			int length = 0, i = 0;
+
+			do {
+				digits[i++] = '0' + integer % 10;
+				integer /= 10;
+			} while (integer);
+			while (i > 0) out[length++] = digits[--i];
+			out[length++] = '.';
+			out[length++] = '0' + thousandths / 100;
+			out[length++] = '0' + thousandths / 10 % 10;
+			out[length++] = '0' + thousandths % 10;
+			return length;
+		}
+	}
+	return sprintf(out,"%.3f",x);
+}
+
+// Write out the CSV lines collected for an outfile
+void csv_flush(outfile *f) {
+	char *p = f->csv;
+
+	while (p < f->csv + f->csv_length) {
+		ssize_t written = write(fileno(f->file), p, f->csv + f->csv_length - p);
+		if (written < 0 && errno == EINTR) continue;
+		if (written < 0) {
+			fprintf(stderr,"Could not write CSV to %s\n",f->name);
+			exit(11);
+		}
+		p += written;
+	}
+	f->csv_length = 0;
+}
+
+// Offers each local maximum in a peak list to the n-highest peaks
+void find_highest_peaks(mxml_node_t *peaksnode, peak_heap *highest) {
 	mxml_node_t *node = mxmlGetParent(peaksnode);
-	void *peaklist = (void *)mxmlGetCustom(peaksnode);
+	long length;
+	void *peaklist = mzXML_get_peaks(peaksnode,&length);
 	int scan_num = atoi(mxmlElementGetAttr(mxmlGetParent(peaksnode),"num"));
 	double RT = xsduration_to_s(mxmlElementGetAttr(node,"retentionTime"));
-	int length = atoi(mxmlElementGetAttr(peaksnode,"compressedLen"));
 	int size = atoi(mxmlElementGetAttr(peaksnode,"precision"))/8;
 	assert(4 == size || 8 == size);
 
@@ -420,43 +1881,135 @@ void find_highest_peaks(mxml_node_t *peaksnode, peak *highest) {
 			I = peaks64[i].I;
 		}
 
-		// Continue to next pair if I lower than lowest of the highest peak list
-		if (I < highest[n_highest-1].I)
-			continue;
-
-		int j;
-		for (j = 0; j < n_highest; ++j) {
-			// If peak with scan_num and mz within distance exists
-			if (abs(highest[j].scan_num - scan_num) < SCAN_DIST &&
-				abs(highest[j].mz - mz) < MZ_DIST) {
-					// If that peak is lower, replace it and sort the array
-					if (highest[j].I < I) {
-						highest[j].scan_num = scan_num;
-						highest[j].RT = RT;
-						highest[j].mz = mz;
-						highest[j].I = I;
-						qsort(highest, n_highest, sizeof(peak), compare_I_peak);
-					}
-					break;
+		heap_offer(highest, scan_num, RT, mz, I);
+	}
+}
+
+// Whether a peak is near scan_num and mz
+// The m/z gap is truncated to a whole number before comparing with MZ_DIST,
+// as the original abs() test did, so peaks within 1 m/z are near
+static inline bool near_peak(const peak *p, unsigned int scan_num, double mz) {
+	return abs((int)(p->scan_num - scan_num)) < SCAN_DIST && abs((int)(p->mz - mz)) < MZ_DIST;
+}
+
+// Whether top peak a sorts below b, by I and then latest set
+static inline bool lower_peak(const top_peak *a, const top_peak *b) {
+	return a->p.I < b->p.I || (a->p.I == b->p.I && a->seq > b->seq);
+}
+
+// Start n-highest peaks with n empty peaks, as the zeroed array used to be
+void heap_init(peak_heap *h, int n) {
+	h->mask = 1;
+	while (h->mask < 2 * n) h->mask <<= 1;
+	h->buckets = malloc(h->mask * sizeof(int));
+	--h->mask;
+	for (int i = 0; i <= h->mask; ++i) h->buckets[i] = -1;
+
+	h->peaks = calloc(n, sizeof(top_peak));
+	h->heap = malloc(n * sizeof(int));
+	for (int i = 0; i < n; ++i) {
+		top_peak *t = &h->peaks[i];
+		unsigned int b = heap_bucket(h, 0, 0);
+
+		// Latest set sorts lowest, so the last peak goes at the root
+		t->seq = i;
+		t->heap_pos = n - 1 - i;
+		h->heap[t->heap_pos] = i;
+		t->next = h->buckets[b];
+		h->buckets[b] = i;
+	}
+	h->seq = n;
+}
+
+// Offer a peak to the n-highest peaks
+// If it is near peaks already there, it replaces the highest of them if it
+// is higher. Otherwise it replaces the lowest peak if it is higher.
+void heap_offer(peak_heap *h, unsigned int scan_num, double RT, double mz, double I) {
+	top_peak *lowest = &h->peaks[h->heap[0]], *near = NULL;
+	long cell_scan = scan_num / SCAN_DIST, cell_mz = floor(mz);
+
+	if (I < lowest->p.I) return;
+
+	// Find the highest near peak, earliest set among equals
+	for (long s = cell_scan - 1; s <= cell_scan + 1; ++s) {
+		for (long m = cell_mz - 1; m <= cell_mz + 1; ++m) {
+			for (int i = h->buckets[heap_bucket(h, s, m)]; i >= 0; i = h->peaks[i].next) {
+				top_peak *t = &h->peaks[i];
+				if (!near_peak(&t->p, scan_num, mz)) continue;
+				if (!near || t->p.I > near->p.I || (t->p.I == near->p.I && t->seq < near->seq))
+					near = t;
 			}
 		}
-		if (j < n_highest) continue;
+	}
+
+	if (near) {
+		if (near->p.I < I) heap_set(h, near, scan_num, RT, mz, I);
+	} else if (I > lowest->p.I) {
+		// A peak equal to the lowest would sort after it and drop out
+		heap_set(h, lowest, scan_num, RT, mz, I);
+	}
+}
 
-		// Peak passed with no neighbor. Add it to end of array of highest entries
-		highest[n_highest].scan_num = scan_num;
-		highest[n_highest].RT = RT;
-		highest[n_highest].mz = mz;
-		highest[n_highest].I = I;
+// Overwrite a top peak with a higher one, moving it in the heap and hash
+void heap_set(peak_heap *h, top_peak *t, unsigned int scan_num, double RT, double mz, double I) {
+	int i = t - h->peaks;
+	int *link = &h->buckets[heap_bucket(h, t->cell_scan, t->cell_mz)];
 
-		// Sort array plus extra value in reverse order to bring highest to front
-		qsort(highest, n_highest+1, sizeof(peak), compare_I_peak);
+	while (*link != i) link = &h->peaks[*link].next;
+	*link = t->next;
+
+	t->p.scan_num = scan_num;
+	t->p.RT = RT;
+	t->p.mz = mz;
+	t->p.I = I;
+	t->seq = h->seq++;
+	t->cell_scan = scan_num / SCAN_DIST;
+	t->cell_mz = floor(mz);
+
+	link = &h->buckets[heap_bucket(h, t->cell_scan, t->cell_mz)];
+	t->next = *link;
+	*link = i;
+
+	heap_sift_down(h, t->heap_pos);
+}
+
+// Move a heap entry that has risen down to its place
+void heap_sift_down(peak_heap *h, int pos) {
+	int n = n_highest;
+
+	while (1) {
+		int low = pos, child;
+		for (child = 2 * pos + 1; child <= 2 * pos + 2 && child < n; ++child)
+			if (lower_peak(&h->peaks[h->heap[child]], &h->peaks[h->heap[low]])) low = child;
+		if (low == pos) break;
+
+		int tmp = h->heap[pos];
+		h->heap[pos] = h->heap[low];
+		h->heap[low] = tmp;
+		h->peaks[h->heap[pos]].heap_pos = pos;
+		h->peaks[h->heap[low]].heap_pos = low;
+		pos = low;
 	}
 }
 
-// qsort comparison function for peaks to sort in REVERSE order by I
-int compare_I_peak(const void *peak1, const void *peak2) {
-	if ((*(peak*)peak2).I < (*(peak*)peak1).I) return -1;
-	else if ((*(peak*)peak2).I > (*(peak*)peak1).I) return 1;
+// Hash bucket of a grid cell
+unsigned int heap_bucket(peak_heap *h, long cell_scan, long cell_mz) {
+	uint64_t k = (uint64_t)cell_scan * 0x9E3779B97F4A7C15ULL ^ (uint64_t)cell_mz * 0xC2B2AE3D27D4EB4FULL;
+	return (k ^ k >> 29) & h->mask;
+}
+
+void heap_free(peak_heap *h) {
+	free(h->peaks);
+	free(h->heap);
+	free(h->buckets);
+}
+
+// qsort comparison function for top peaks to sort in REVERSE order by I
+// Peaks of equal I are in the order they were set, as a stable sort leaves
+int compare_top_peak(const void *peak1, const void *peak2) {
+	const top_peak *a = peak1, *b = peak2;
+	if (lower_peak(b, a)) return -1;
+	else if (lower_peak(a, b)) return 1;
 	else return 0;
 }
 
@@ -466,6 +2019,11 @@ void usage(char** argv) {
 	printf("\n");
 	printf("Flags: -s <scanType> Keep scans of this scanType (default %s)\n", DEFAULT_SCAN_TYPE);
 	printf("                     e.g. calibration, zoom, SIM, SRM, CRM, Q1, Q3\n");
+	printf("                     (repeat to keep several types in one outfile)\n");
+	printf("       --ms-level <n>\n");
+	printf("                     Keep scans of this msLevel (default all)\n");
+	printf("       --polarity <+/->\n");
+	printf("                     Keep scans of this polarity (default both)\n");
 	printf("       -p <a/e/o>    Keep \"a\"ll (default), \"e\"ven or \"o\"dd scans\n");
 	printf("\n");
 	printf("       -n <scannum>  Minimum scan number (default 0)\n");
@@ -476,11 +2034,39 @@ void usage(char** argv) {
 	printf("       -m <m/z>      Minimum m/z in u/e (default 0)\n");
 	printf("       -M <m/z>      Minimum m/z in u/e (default max)\n");
 	printf("       -i <I>        Minimum peak intensity (default 0)\n");
+	printf("       -k <k>        Minimum peak intensity in sigma above the median\n");
+	printf("                     of each scan, from its MAD (default off)\n");
+	printf("       --centroid    Reduce each profile peak to a centroid at its apex\n");
+	printf("                     in TOF with its summed intensity (before -i, -k)\n");
+	printf("       --smooth <k>     Smooth profile intensities along RT in each TOF\n");
+	printf("                     bin over the 2k+1 kept scans of its scanType (and\n");
+	printf("                     parity if split) centred on each scan\n");
+	printf("                     (quadratic Savitzky-Golay, k >= %d)\n", MIN_SMOOTH_K);
+	printf("       --persist <k>[,<tolerance>]\n");
+	printf("                     Drop peaks with no other within tolerance m/z in\n");
+	printf("                     the k kept scans either side (default tolerance %.3f)\n", DEFAULT_PERSIST_TOLERANCE);
+	printf("       --lock-mass <m/z>[,<tolerance>]\n");
+	printf("                     Correct m/z drift over RT from this lock mass in\n");
+	printf("                     %s scans (default tolerance %.3f); streaming\n", LOCK_SCAN_TYPE, DEFAULT_LOCK_TOLERANCE);
+	printf("                     holds at most %d scans for the next calibration\n", HOLD_MAX);
+	printf("                     scan, and warns if any had to go before it\n");
 	printf("\n");
 	printf("       -c            Write CSV instead of mzXML\n");
 	printf("       -x            Do not write anything (for use with -h below)\n");
+	printf("       --summary     Write a JSON summary of the run to outname, or to\n");
+	printf("                     stdout if none, in one streaming pass (-v output\n");
+	printf("                     then goes to stderr)\n");
 	printf("       -z            Do not compress peaklists in mzXML output\n");
+	printf("       --tof         Code peaklists in mzXML output losslessly as TOF grid\n");
+	printf("                     indices (compressionType \"tof\", not mzXML compliant)\n");
 	printf("       -r            Do not renumber scans (mzXML incompliant)\n");
+	printf("       -f            Stream scans to output as they are read\n");
+	printf("                     (Constant memory, needs a seekable outname)\n");
+	printf("       -j <n>        Decode peaks on n threads (default all cores)\n");
+	printf("       --split <how> Write to several outfiles in one streaming pass,\n");
+	printf("                     splitting by parity, type:<scanType,...> or\n");
+	printf("                     mz:<m/z,...> (repeat to combine splits; outfiles are\n");
+	printf("                     named outname.<scanType>.<even/odd>.<block>)\n");
 	printf("\n");
 	printf("       -h <n>        Display the n highest peaks (default 0)\n");
 	printf("                     (Peaks typically extend across 10s RT and 0.5 m/z)\n");
@@ -5,13 +5,21 @@
 
 #define N_SCANS 600
 #define N_MZPOINTS 20000
-#define N_FLAG 200000
+#define N_FLAG 200000 // Default number of cluster flags
 #define N_PREV 2
 #define MIN_CLUSTER_SIZE 20
 #define MAX_MERGES 0
 
+// Cluster colors are derived from the scan and m/z of the first point in the
+// cluster, so they do not depend on window sizes or flag recycling order
+#define NO_COLOR -1LL
+#define COLOR_MZ_SCALE 10000        // m/z resolution of colors (bins per u/e)
+#define COLOR_MZ_BINS 1000000000LL  // m/z bins per scan in color numbers
+#define CLUST_FN_LEN 32
+
 typedef struct {
-	int color, last_seen;
+	long long color;
+	int last_seen;
 } Flag;
 
 typedef struct {
@@ -19,6 +27,33 @@ typedef struct {
 	Flag *cluster_flag; // Pointer to cluster point belongs to (NULL if none)
 } Point;
 
+// Minimum statistics a finished cluster needs to be written out
+typedef struct {
+	int min_pts;
+	double min_sum_I, min_max_I, min_RT_span, min_mz_span;
+} Filter;
+
+enum {
+	FILTER_SIZE, FILTER_SUM_I, FILTER_MAX_I, FILTER_RT_SPAN, FILTER_MZ_SPAN,
+	N_FILTERS
+};
+
+// Clusters and points removed by each filter
+typedef struct {
+	int clusters[N_FILTERS];
+	long points[N_FILTERS];
+} Filtercount;
+
+typedef struct {
+	int pts;
+	double sum_I, max_I, min_RT, max_RT, min_mz, max_mz;
+} Clusterstats;
+
+// Peak bytes used per cluster flag: flags[] and latest[], the color hash
+// tables of getlatestFlags() and colorTable() (up to 4 ints a flag, after
+// rounding up to a power of 2), and the stats and keep[] of writeClusters()
+#define FLAG_BYTES (2*sizeof(Flag) + 4*sizeof(int) + sizeof(Clusterstats) + 1)
+
 typedef struct {
 	int dim1, dim2, base;
 	double *RTs;
@@ -31,11 +66,28 @@ int appendfile (const char*, const char*);
 int getnextFlag(const Flag*, int, int);
 int getlatestFlags(const Flag*, int, Flag*);
 int freshenFlags(Flag*, int, const Flag*, int);
-int writeClusters(Point**,int,int,const Flag*,int,int,const double*,int,int);
-int clearoldFlags(Flag*, int, const Flag*, int, int, int);
-int mergeColors(Flag*, int, const Flag*, int);
+int *colorTable(const Flag*, int, int*);
+int findColor(const int*, int, const Flag*, long long);
+int filterCluster(const Filter*, const Clusterstats*);
+int writeClusters(Point**,int,int,const Flag*,int,int,const double*,int,
+					const Filter*,Filtercount*);
+int clearoldFlags(Flag*, int, const Flag*, int, int);
+int detachPoints(Point**, int, int, int);
+int evictClusters(Point**, int, int, Flag*, int, Flag*, int, const double*, int,
+					const Filter*, Filtercount*);
+int mergeColors(Flag*, int, const Flag*, long long);
+long long clusterColor(int, double, long long);
+int clusterFilename(char*, long long);
 
 Point** Pointmatrix(int, int);
 void freePointmatrix(Point**);
 int stepPointmatrix(Point**, int, int, int);
 int stepDoubles(double*, int, int);
+
+int findmzWindow(const Point*, int, int, double, double, int*);
+int findmzWindowCursor(const Point*, int, int, double, double, int*);
+int findmzWindow_scalar(const Point*, int, int, double, double, int*);
+#if defined(__x86_64__) || defined(__i386__)
+int findmzWindow_sse2(const Point*, int, int, double, double, int*);
+int findmzWindow_avx2(const Point*, int, int, double, double, int*);
+#endif
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "clm.h"
 
 // Return index to next available flag in an array of flags or <0 for error
@@ -22,27 +23,40 @@ int getnextFlag(const Flag *flags, int len, int current) {
 	return -2; // No available flag found
 }
 
+// Slot of color in an open-addressed hash table of size (a power of 2)
+static int colorHash(long long color, int size) {
+	return (int)(((unsigned long long)color * 0x9E3779B97F4A7C15ULL) >> 32)
+				& (size - 1);
+}
+
 // Return the number of unique colors in flags[] (or <0 for error) and latest 
 // last_seen for each of those colors in latest[] (len(latest[]) >= len)
+// Colors already in latest[] are found through a hash table, in O(len)
 int getlatestFlags(const Flag *flags, int len, Flag *latest) {
 	int tail = 0;
-	int a,b;
+	int a, h, size;
 
 	// Invalid arguments
 	if (len <= 0) return -1;
 
+	for (size = 16; size < 2*len; size <<= 1);
+	int *table = malloc(size * sizeof(int));
+	if (!table) return -3;
+	for (h=0; h<size; ++h) table[h] = -1;
+
 	// Populate latest[] with the latest last_seen for each used color
 	for (a=0; a<len; ++a) {
 		if (flags[a].last_seen < 0) continue;
-		for (b=0; b<tail; ++b) {
-			if (flags[a].color == latest[b].color) {
-				if (latest[b].last_seen < flags[a].last_seen)
-					latest[b].last_seen = flags[a].last_seen;
-				break;
-			}
-		}
-		if (b >= tail) latest[tail++] = flags[a]; // Add unseen color to latest
+		for (h = colorHash(flags[a].color, size); table[h] >= 0;
+				h = (h + 1) & (size - 1))
+			if (latest[table[h]].color == flags[a].color) break;
+		if (table[h] < 0) { // Add unseen color to latest
+			table[h] = tail;
+			latest[tail++] = flags[a];
+		} else if (latest[table[h]].last_seen < flags[a].last_seen)
+			latest[table[h]].last_seen = flags[a].last_seen;
 	}
+	free(table);
 	return tail; // tail == len(latest[])
 }
 
@@ -50,147 +64,272 @@ int getlatestFlags(const Flag *flags, int len, Flag *latest) {
 // Return the number of flags freshened or <0 for error
 int freshenFlags(Flag *flags, int len, const Flag *latest, int tail) {
 	int freshened = 0;
-	int a,b;
+	int a, b, size;
 
 	// Invalid arguments
 	if (len <= 0) return -1;
 	if (tail <= 0) return -1;
 
+	int *table = colorTable(latest, tail, &size);
+	if (!table) return -3;
 	for(a=0;a<len;++a) {
 		if (flags[a].last_seen < 0) continue;
-		for (b=0; b<tail; ++b) {
-			if (flags[a].color == latest[b].color) {
-				if (flags[a].last_seen < latest[b].last_seen) {
-					flags[a].last_seen = latest[b].last_seen;
-					++freshened;
-				}
-			}
+		b = findColor(table, size, latest, flags[a].color);
+		if (b >= 0 && flags[a].last_seen < latest[b].last_seen) {
+			flags[a].last_seen = latest[b].last_seen;
+			++freshened;
 		}
 	}
+	free(table);
 	return freshened;
 }
 
+// Return the color for a cluster starting at scan and mz, or <0 for error
+// Colors sort by scan then mz; if prev (the last color given out in the same
+// scan, or NO_COLOR) is not lower, the next free color above it is returned
+long long clusterColor(int scan, double mz, long long prev) {
+	long long bin = (long long)(mz * COLOR_MZ_SCALE + 0.5);
+
+	// Invalid arguments
+	if (scan < 0) return -1;
+	if (bin < 0 || bin >= COLOR_MZ_BINS) return -1;
+
+	long long color = scan * COLOR_MZ_BINS + bin;
+	if (color <= prev) color = prev + 1;
+	return color;
+}
+
+// Write the output filename for color to buf (at least CLUST_FN_LEN long)
+int clusterFilename(char *buf, long long color) {
+	return sprintf(buf, "%06lld_%09lld.clust", color / COLOR_MZ_BINS,
+					color % COLOR_MZ_BINS);
+}
+
 // Write a single point to a file
 int writePoint(FILE *outfile, int scan_no, double RT, double mz, double I) {
 	return fprintf(outfile,"%6d %9.3lf %9.3lf %9.3lf\n",scan_no,RT,mz,I);
 }
 
-// Write clusters in mtx[][] with colors older than scan and at least min points
+// Build an open-addressed hash table of size *size mapping colors in latest[]
+// to their index, returning the table (to be freed) or NULL for error
+int *colorTable(const Flag *latest, int tail, int *size) {
+	int a, h;
+
+	for (*size = 16; *size < 2*tail; *size <<= 1);
+	int *table = malloc(*size * sizeof(int));
+	if (!table) return NULL;
+	for (h=0; h<*size; ++h) table[h] = -1;
+
+	for (a=0; a<tail; ++a) {
+		h = colorHash(latest[a].color, *size);
+		while (table[h] >= 0) h = (h + 1) & (*size - 1);
+		table[h] = a;
+	}
+	return table;
+}
+
+// Return the index in latest[] of color using colorTable() or -1 if absent
+int findColor(const int *table, int size, const Flag *latest, long long color){
+	int h = colorHash(color, size);
+
+	for (; table[h] >= 0; h = (h + 1) & (size - 1))
+		if (latest[table[h]].color == color) return table[h];
+	return -1;
+}
+
+// Return the index of the first filter that rejects a cluster with stats st,
+// or -1 if it passes all of them
+int filterCluster(const Filter *filter, const Clusterstats *st) {
+	if (st->pts < filter->min_pts) return FILTER_SIZE;
+	if (st->sum_I < filter->min_sum_I) return FILTER_SUM_I;
+	if (st->max_I < filter->min_max_I) return FILTER_MAX_I;
+	if (st->max_RT - st->min_RT < filter->min_RT_span) return FILTER_RT_SPAN;
+	if (st->max_mz - st->min_mz < filter->min_mz_span) return FILTER_MZ_SPAN;
+	return -1;
+}
+
+// Write clusters in mtx[][] with colors older than scan and passing filter
 // to separate files in cwd, given the output of getlatestseenFlags() and RT[]
+// Clusters already on disk always pass, and a NULL filter passes everything.
+// Clusters and points rejected by each filter are added to removed (if given)
 // Return the number of clusters written or <0 for error (mtx must be freshened)
 int writeClusters(Point **mtx,int dim1,int dim2,const Flag *latest,int tail,
-		int scan, const double *RT, int scan_base, int min) {
+		int scan, const double *RT, int scan_base, const Filter *filter,
+		Filtercount *removed) {
 	// Invalid arguments
 	if (dim1 <= 0) return -1;
 	if (dim2 <= 0) return -1;
 	if (tail < 0) return -1;
 	if (scan < 0) return -1;
-	if (min < 0) return -1;
 
 	// Nothing to do
 	if (tail == 0) return 0;
 
-	int a, b, c;
+	int a, b, c, size;
 	int written = 0;
-	int pts[tail];
-	memset(pts, 0, sizeof pts);
-
-	// Assign ptbuf[tail][min][4] on the heap
-	double ***ptbuf = NULL;
-	if (--min > 0) {
-		ptbuf = malloc(tail * sizeof(double**));
-		ptbuf[0] = malloc(tail * min * sizeof(double*));
-		ptbuf[0][0] = malloc(tail * min * 4 * sizeof(double));
-		for (a=0; a<tail; ++a) {
-			if (a > 0) {
-				ptbuf[a] = ptbuf[a-1] + min;
-				ptbuf[a][0] = ptbuf[a-1][0] + min*4;
+	int *table = colorTable(latest, tail, &size);
+	Clusterstats *stats = calloc(tail, sizeof(Clusterstats));
+	char *keep = calloc(tail, 1);
+	if (!table || !stats || !keep) {
+		free(table);
+		free(stats);
+		free(keep);
+		return -3;
+	}
+
+	// Gather statistics of points to be written for each color
+	for (b=0; b<dim1; ++b) {
+		for (c=0; c<dim2; ++c) {
+			if (!mtx[b][c].mz) break;
+			if (!mtx[b][c].cluster_flag) continue; // Already written
+			if (mtx[b][c].cluster_flag->last_seen < 0) continue;
+			if (mtx[b][c].cluster_flag->last_seen < scan) { // Assume freshened
+				a = findColor(table, size, latest, mtx[b][c].cluster_flag->color);
+				if (a < 0) continue;
+
+				Clusterstats *st = &stats[a];
+				if (!st->pts++) {
+					st->min_RT = st->max_RT = RT[b];
+					st->min_mz = st->max_mz = mtx[b][c].mz;
+				}
+				st->sum_I += mtx[b][c].I;
+				if (mtx[b][c].I > st->max_I) st->max_I = mtx[b][c].I;
+				if (RT[b] < st->min_RT) st->min_RT = RT[b];
+				if (RT[b] > st->max_RT) st->max_RT = RT[b];
+				if (mtx[b][c].mz < st->min_mz) st->min_mz = mtx[b][c].mz;
+				if (mtx[b][c].mz > st->max_mz) st->max_mz = mtx[b][c].mz;
+			}
+		}
+	}
+
+	// Decide which colors to write before any bytes hit disk
+	for (a=0; a<tail; ++a) {
+		if (!stats[a].pts) continue;
+		keep[a] = 1;
+		if (!filter) continue;
+
+		int f = filterCluster(filter, &stats[a]);
+		if (f >= 0) {
+			// Keep the rest of clusters that were partly written before
+			char buf[CLUST_FN_LEN];
+			struct stat st;
+			clusterFilename(buf,latest[a].color);
+			if (!stat(buf,&st)) continue;
+
+			keep[a] = 0;
+			if (removed) {
+				++removed->clusters[f];
+				removed->points[f] += stats[a].pts;
 			}
-			for (b=1; b<min; ++b)
-				ptbuf[a][b] = ptbuf[a][b-1] + 4;
 		}
 	}
 
 	for (b=0; b<dim1; ++b) {
 		for (c=0; c<dim2; ++c) {
 			if (!mtx[b][c].mz) break;
+			if (!mtx[b][c].cluster_flag) continue; // Already written
 			if (mtx[b][c].cluster_flag->last_seen < 0) continue;
 			if (mtx[b][c].cluster_flag->last_seen < scan) { // Assume freshened
-				// Find this color's index
-				for (a=0; a<tail; ++a)
-					if (mtx[b][c].cluster_flag->color == latest[a].color) break;
-				//assert(a<tail);
-
-				if (pts[a]<min) {
-					// Buffer point until we have enough to write
-					ptbuf[a][pts[a]][0] = scan_base + b;
-					ptbuf[a][pts[a]][1] = RT[b];
-					ptbuf[a][pts[a]][2] = mtx[b][c].mz;
-					ptbuf[a][pts[a]][3] = mtx[b][c].I;
-				} else {
-					// Open file to append the cluster to
-					char buf[13];
-					sprintf(buf,"%06d.clust",latest[a].color);
-
-					FILE *outfile = fopen(buf, "a");
-					if (!outfile) return -2; // Could not open file
-
-					if (pts[a]==min) {
-						// Dump this color's buffer to new file
-						int d;
-						for (d=0; d<min; ++d)
-							writePoint(outfile,(int)ptbuf[a][d][0],
-								ptbuf[a][d][1],ptbuf[a][d][2],ptbuf[a][d][3]);
-						++written;
-					}
-					writePoint(outfile,scan_base+b,RT[b],mtx[b][c].mz,
-								mtx[b][c].I);
-					fclose(outfile);
+				a = findColor(table, size, latest, mtx[b][c].cluster_flag->color);
+				if (a < 0 || !keep[a]) continue;
+
+				// Open file to append the cluster to
+				char buf[CLUST_FN_LEN];
+				clusterFilename(buf,latest[a].color);
+
+				FILE *outfile = fopen(buf, "a");
+				if (!outfile) {
+					written = -2; // Could not open file
+					goto done;
+				}
+				writePoint(outfile,scan_base+b,RT[b],mtx[b][c].mz,mtx[b][c].I);
+				fclose(outfile);
+				if (keep[a] == 1) {
+					keep[a] = 2;
+					++written;
 				}
-				++pts[a];
 			}
 		}
 	}
-	if (ptbuf) {
-		free(ptbuf[0][0]);
-		free(ptbuf[0]);
-		free(ptbuf);
-	}
+
+done:
+	free(table);
+	free(stats);
+	free(keep);
 	return written;
 }
 
-// Mark old flags as available and give them unique new color numbers, given the
-// output of getlatestFlags() and the next highest color to use
-// Return new highest color or <0 for error
-int clearoldFlags(Flag *flags, int len, const Flag *latest, int tail, int scan,
-					int curr_color){
-	int a,b;
+// Mark flags with colors older than scan as available, given the output of
+// getlatestFlags()
+// Return number of flags cleared or <0 for error
+int clearoldFlags(Flag *flags, int len, const Flag *latest, int tail, int scan){
+	int a, b, size, cleared = 0;
 
 	// Invalid arguments
 	if (len <= 0) return -1;
 	if (tail <= 0) return -1;
 	if (scan < 0) return -1;
-	if (curr_color < 0) return -1;
 
+	int *table = colorTable(latest, tail, &size);
+	if (!table) return -3;
 	for (a=0; a<len; ++a) {
 		if (flags[a].last_seen == -1) continue;
-		for (b=0; b<tail; ++b) {
-			if (flags[a].color == latest[b].color) {
-				if (latest[b].last_seen < scan) {
-					flags[a].color = curr_color++;
-					flags[a].last_seen = -1;
-				}
-				break;
+		b = findColor(table, size, latest, flags[a].color);
+		if (b >= 0 && latest[b].last_seen < scan) {
+			flags[a].color = NO_COLOR;
+			flags[a].last_seen = -1;
+			++cleared;
+		}
+	}
+	free(table);
+
+	return cleared;
+}
+
+// Detach points in mtx[][] from flags last seen before scan, so that the flags
+// can be reused without the old points (mtx must be freshened)
+// Return the number of points detached or <0 for error
+int detachPoints(Point **mtx, int dim1, int dim2, int scan) {
+	int b, c, detached = 0;
+
+	// Invalid arguments
+	if (dim1 <= 0) return -1;
+	if (dim2 <= 0) return -1;
+	if (scan < 0) return -1;
+
+	for (b=0; b<dim1; ++b) {
+		for (c=0; c<dim2; ++c) {
+			if (!mtx[b][c].mz) break;
+			if (!mtx[b][c].cluster_flag) continue;
+			if (mtx[b][c].cluster_flag->last_seen < scan) {
+				mtx[b][c].cluster_flag = NULL;
+				++detached;
 			}
 		}
 	}
+	return detached;
+}
+
+// Write out and free the flags of all clusters last seen before scan, using
+// rows 0..dim1-1 of mtx[][] and latest[] as scratch (len(latest[]) >= len)
+// Return the number of flags freed or <0 for error
+int evictClusters(Point **mtx, int dim1, int dim2, Flag *flags, int len,
+		Flag *latest, int scan, const double *RT, int scan_base,
+		const Filter *filter, Filtercount *removed) {
+	int tail = getlatestFlags(flags, len, latest);
 
-	return curr_color;
+	if (tail < 0) return -1;
+	if (tail == 0) return 0; // Nothing to do
+	if (freshenFlags(flags, len, latest, tail) < 0) return -1;
+	if (writeClusters(mtx, dim1, dim2, latest, tail, scan, RT, scan_base,
+		filter, removed) < 0) return -2;
+	if (detachPoints(mtx, dim1, dim2, scan) < 0) return -1;
+	return clearoldFlags(flags, len, latest, tail, scan);
 }
 
 // Change all flags with old_color to be the same as new_flag
 // Return number of flags changed or <0 for error
-int mergeColors(Flag *flags, int len, const Flag *new_flag, int old_color) {
+int mergeColors(Flag *flags, int len, const Flag *new_flag, long long old_color){
 	if (len <= 0) return -1; // Invalid arguments
 	if (old_color == new_flag->color) return 0; //Nothing to do
 
@@ -16,17 +16,70 @@ int main(int argc, char** argv)
 	FILE *infile;
 	Point **points;
 	double RTs[N_SCANS] = {0};
-	Flag flags[N_FLAG], latest[N_FLAG];
+	Flag *flags, *latest;
+	int n_flags = N_FLAG, evictions = 0;
 
 	int scan_idx = -1, mz_idx = 0, current_flag = 0, scan_base = 0, tail;
-	int curr_color = 0, RT_step = N_SCANS/3;
+	int RT_step = N_SCANS/3;
+	long long last_color = NO_COLOR; // Last color given out in this scan
+	int cursor[N_PREV] = {0}; // Search start in each previous scan
+	int row_len[N_PREV] = {0}; // Number of points in each previous scan
+	double last_mz = 0;
 	//int line_ctr = 0; //DEBUG
 
+	Filter filter = {MIN_CLUSTER_SIZE, 0, 0, 0, 0};
+	Filtercount removed = {{0}, {0}};
+	const char *filter_names[N_FILTERS] = {"points", "total intensity",
+		"max intensity", "RT span", "m/z span"};
+
 	// Check command line arguments, print usage if wrong
-	if ( argc < 3 ) {
-		fprintf (stderr, "Usage: %s <input table> <output dir>\n", argv[0]);
+	int opt;
+	while ((opt = getopt(argc, argv, "n:i:p:t:m:b:")) != -1) {
+		switch (opt) {
+			case 'b':
+				// Memory budget in MB for flags and their scratch
+				n_flags = atof(optarg) * 1024 * 1024 / FLAG_BYTES;
+				break;
+			case 'n':
+				filter.min_pts = atoi(optarg);
+				break;
+			case 'i':
+				filter.min_sum_I = atof(optarg);
+				break;
+			case 'p':
+				filter.min_max_I = atof(optarg);
+				break;
+			case 't':
+				filter.min_RT_span = atof(optarg);
+				break;
+			case 'm':
+				filter.min_mz_span = atof(optarg);
+				break;
+			default:
+				break;
+		}
+	}
+	if ( argc - optind < 2 ) {
+		fprintf (stderr, "Usage: %s [flags] <input table> <output dir>\n",
+					argv[0]);
+		fprintf (stderr, "\n");
+		fprintf (stderr, "Flags: -n <points> Minimum points in a cluster "
+					"(default %d)\n", MIN_CLUSTER_SIZE);
+		fprintf (stderr, "       -i <I>      Minimum total intensity of a "
+					"cluster (default 0)\n");
+		fprintf (stderr, "       -p <I>      Minimum peak intensity of a "
+					"cluster (default 0)\n");
+		fprintf (stderr, "       -t <RT>     Minimum RT span of a cluster in s "
+					"(default 0)\n");
+		fprintf (stderr, "       -m <m/z>    Minimum m/z span of a cluster "
+					"(default 0)\n");
+		fprintf (stderr, "       -b <MB>     Memory budget for cluster flags "
+					"and their scratch tables\n"
+					"                   (%d bytes a flag, default %.1f)\n",
+					(int)FLAG_BYTES, (double)N_FLAG*FLAG_BYTES/(1024*1024));
 		exit (1);
 	}
+	argv += optind - 1;
 
 	// Ensure output dir does not already exist
 	struct stat st;
@@ -53,8 +106,14 @@ int main(int argc, char** argv)
 		infox ("Couldn't create matrix.", -1, __FILE__, __LINE__);
 
 	// Initialize flags;
-	for(a = 0; a<N_FLAG; ++a) {
-		flags[a].color = curr_color++;
+	if (n_flags <= 0)
+		infox("Memory budget too small for any flags", -1, __FILE__, __LINE__);
+	flags = malloc(n_flags * sizeof(Flag));
+	latest = malloc(n_flags * sizeof(Flag));
+	if (!flags || !latest)
+		infox("Couldn't allocate flags.", -1, __FILE__, __LINE__);
+	for(a = 0; a<n_flags; ++a) {
+		flags[a].color = NO_COLOR;
 		flags[a].last_seen = -1;
 	}
 
@@ -81,31 +140,32 @@ int main(int argc, char** argv)
 				int last_scan = scan_base + scan_idx - N_PREV - 2;
 				if (last_scan > 0) {
 					// Write out old clusters
-					int tail = getlatestFlags(flags, N_FLAG, latest);
+					int tail = getlatestFlags(flags, n_flags, latest);
 					if (tail <= 0)
 						infox("Couldn't get latest flags",-5,__FILE__,__LINE__);
-					if (freshenFlags(flags,N_FLAG,latest,tail) < 0)
+					if (freshenFlags(flags,n_flags,latest,tail) < 0)
 						infox("Couldn't freshen flags",-5,__FILE__,__LINE__);
 					if (writeClusters(points,N_SCANS,N_MZPOINTS,latest,tail,
-						last_scan,RTs,scan_base,MIN_CLUSTER_SIZE) < 0)
+						last_scan,RTs,scan_base,&filter,&removed) < 0)
 						infox("Couldn't write cluster",-6,__FILE__,__LINE__);
 
-					// Clear old flags
-					curr_color=clearoldFlags(flags,N_FLAG,latest,tail,last_scan,
-												curr_color);
-					if (curr_color < 0)
+					// Clear old flags, detaching their points first so that
+					// they are not written again when the flags are reused
+					if (detachPoints(points,N_SCANS,N_MZPOINTS,last_scan) < 0)
+						infox("Couldn't detach points",-7,__FILE__,__LINE__);
+					if (clearoldFlags(flags,n_flags,latest,tail,last_scan) < 0)
 						infox("Couldn't update flags",-7,__FILE__,__LINE__);
 
 					// Write out the parts of current clusters that would be
-					// lost on stepping (i.e. long clusters)
+					// lost on stepping (i.e. long clusters), unfiltered
 					if (writeClusters(points,RT_step,N_MZPOINTS,latest,tail,
-						(scan_base+scan_idx+1),RTs,scan_base,0) < 0)
+						(scan_base+scan_idx+1),RTs,scan_base,NULL,NULL) < 0)
 						infox("Couldn't write cluster",-6,__FILE__,__LINE__);
 
 					// Update current_flag
-					current_flag = getnextFlag(flags, N_FLAG, current_flag);
+					current_flag = getnextFlag(flags, n_flags, current_flag);
 					if (current_flag < 0)
-						infox("Out of cluster flags. Increase N_FLAG.", -3,
+						infox("Out of cluster flags. Raise memory budget.", -3,
 								__FILE__, __LINE__);
 				}
 
@@ -116,8 +176,12 @@ int main(int argc, char** argv)
 					infox ("Couldn't step RTs.", -4, __FILE__, __LINE__);
 				scan_base += RT_step;
 			}
+			for (a = N_PREV-1; a > 0; --a) row_len[a] = row_len[a-1];
+			row_len[0] = mz_idx + 1;
 			mz_idx = 0;
 			RTs[scan_idx] = RT;
+			last_color = NO_COLOR;
+			for (a = 0; a < N_PREV; ++a) cursor[a] = 0;
 		} else {
 			mz_idx++;
 			if (mz_idx >= N_MZPOINTS)
@@ -128,15 +192,22 @@ int main(int argc, char** argv)
 		points[scan_idx][mz_idx].mz = mz;
 		points[scan_idx][mz_idx].I = I;
 
+		// Points within a scan should arrive sorted by mz, so each search can
+		// start where the last one did. Start over if they are not.
+		if (mz < last_mz)
+			for (a = 0; a < N_PREV; ++a) cursor[a] = 0;
+		last_mz = mz;
+
 		int merges = 0;
 		for (a = scan_idx-1; a >= scan_idx-N_PREV ; --a) {
 			if (a < 0) break;
 
-			for (b = 0; b < N_MZPOINTS; ++b) {
-				if (!points[a][b].mz) break;
-				if (points[a][b].mz - mz < -MZ_DIST) continue;
-				if (points[a][b].mz - mz >  MZ_DIST) break;
-
+			// Find neighbours within MZ_DIST in previous scan
+			int end;
+			b = findmzWindowCursor(points[a], cursor[scan_idx-1-a],
+								row_len[scan_idx-1-a], mz, MZ_DIST, &end);
+			cursor[scan_idx-1-a] = b;
+			for (; b < end; ++b) {
 				if (!points[a][b].cluster_flag)
 					infox("Neighbour has no cluster!", -10, __FILE__, __LINE__);
 
@@ -145,18 +216,23 @@ int main(int argc, char** argv)
 					points[scan_idx][mz_idx].cluster_flag =
 						points[a][b].cluster_flag;
 				} else {
-					if (points[scan_idx][mz_idx].cluster_flag->color !=
-						points[a][b].cluster_flag->color) {
-						// Merge clusters
+					Flag *keep = points[scan_idx][mz_idx].cluster_flag;
+					Flag *gone = points[a][b].cluster_flag;
+					if (keep->color != gone->color) {
+						// Merge clusters, keeping the lower (earlier) color
+						if (gone->color < keep->color) {
+							keep = points[a][b].cluster_flag;
+							gone = points[scan_idx][mz_idx].cluster_flag;
+						}
+						keep->last_seen = scan_base + scan_idx;
+
 						// Check if file for old color exists
-						char old_fn[13];
-						sprintf(old_fn,"%06d.clust",
-								points[a][b].cluster_flag->color);
+						char old_fn[CLUST_FN_LEN];
+						clusterFilename(old_fn, gone->color);
 						struct stat st;
 						if (!stat(old_fn,&st)) {
-							char new_fn[13];
-							sprintf(new_fn,"%06d.clust",
-									points[scan_idx][mz_idx].cluster_flag->color);
+							char new_fn[CLUST_FN_LEN];
+							clusterFilename(new_fn, keep->color);
 							if (stat(new_fn,&st)) {
 							// If file for new color does not exist, just rename
 							printf("Renaming %s to %s\n",old_fn,new_fn);//DEBUG
@@ -177,9 +253,7 @@ int main(int argc, char** argv)
 							}
 						}
 
-						if (mergeColors(flags,N_FLAG,
-							points[scan_idx][mz_idx].cluster_flag,
-							points[a][b].cluster_flag->color) < 0)
+						if (mergeColors(flags,n_flags,keep,gone->color) < 0)
 							infox("Could not merge",-8,__FILE__,__LINE__);
 						if (++merges > MAX_MERGES) break;
 					}
@@ -188,28 +262,56 @@ int main(int argc, char** argv)
 			if (merges > MAX_MERGES) break;
 		}
 		if (!points[scan_idx][mz_idx].cluster_flag) {
+			// Start a new cluster colored by this point
+			last_color = clusterColor(scan_base+scan_idx, mz, last_color);
+			if (last_color < 0)
+				infox("Couldn't color cluster", -9, __FILE__, __LINE__);
 			points[scan_idx][mz_idx].cluster_flag = &(flags[current_flag]);
+			flags[current_flag].color = last_color;
 			flags[current_flag].last_seen = scan_base+scan_idx;
-			current_flag = getnextFlag(flags, N_FLAG, current_flag);
+			int next_flag = getnextFlag(flags, n_flags, current_flag);
+			int cutoff = scan_base+scan_idx-N_PREV;
+			if (next_flag < 0 && cutoff >= 0) {
+				// Out of flags, so write out clusters that are too old to be
+				// touched again and reuse their flags (none are in the
+				// first N_PREV scans)
+				if (evictClusters(points,scan_idx+1,N_MZPOINTS,flags,n_flags,
+					latest,cutoff,RTs,scan_base,&filter,&removed) < 0)
+					infox("Couldn't evict clusters",-6,__FILE__,__LINE__);
+				++evictions;
+				next_flag = getnextFlag(flags, n_flags, current_flag);
+			}
+			current_flag = next_flag;
 			if (current_flag < 0)
-				infox("Out of cluster flags. Increase N_FLAG.",-3,
+				infox("Out of cluster flags. Raise memory budget.",-3,
 						__FILE__, __LINE__);
 		}
 	}
 
 	// Output remaining clusters
-	tail = getlatestFlags(flags, N_FLAG, latest);
+	tail = getlatestFlags(flags, n_flags, latest);
 	if (tail < 0)
 		infox("Couldn't get latest flags",-5,__FILE__,__LINE__);
 	else if (tail > 0)
-		if (freshenFlags(flags,N_FLAG,latest,tail) < 0)
+		if (freshenFlags(flags,n_flags,latest,tail) < 0)
 			infox("Couldn't freshen flags",-5,__FILE__,__LINE__);
 		if (writeClusters(points,N_SCANS,N_MZPOINTS,latest,tail,
-			(scan_base+scan_idx+1),RTs,scan_base,MIN_CLUSTER_SIZE) < 0)
+			(scan_base+scan_idx+1),RTs,scan_base,&filter,&removed) < 0)
 			infox("Couldn't write cluster",-6,__FILE__,__LINE__);
 
+	// Report what the filters removed
+	for (a = 0; a < N_FILTERS; ++a)
+		printf("Removed %d clusters (%ld points) on %s\n", removed.clusters[a],
+				removed.points[a], filter_names[a]);
+
+	if (evictions)
+		printf("Evicted old clusters %d times to stay within memory budget\n",
+				evictions);
+
 	// printf ("Number of cluster flags used: %d\n", current_flag); //DEBUG
 	fclose(infile);
+	free(flags);
+	free(latest);
 	freePointmatrix(points);
 	if (chdir(cwd) == -1)
 		infox("Couldn't chdir!",-254,__FILE__,__LINE__);
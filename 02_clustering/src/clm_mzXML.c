@@ -138,7 +138,7 @@ void fill_point_buffer
 		// Load up the peak list
 		peaksnode = mxmlFindElement(node, node, "peaks", NULL, NULL, MXML_DESCEND);
 		int peaks = atoi(mxmlElementGetAttr(node, "peaksCount"));\
-		void *peaklist = (void *)mxmlGetCustom(peaksnode);
+		void *peaklist = mzXML_get_peaks(peaksnode, NULL);
 		int size = atoi(mxmlElementGetAttr(peaksnode,"precision"))/8;
 		assert(4 == size || 8 == size);
 		
@@ -178,7 +178,7 @@ double get_lowest_t_gap(mxml_node_t *node) {
 	
 	mxml_node_t *peaksnode = mxmlFindElement(node, node, "peaks", NULL, NULL, MXML_DESCEND);
 	int peaks = atoi(mxmlElementGetAttr(node, "peaksCount"));
-	void *peaklist = (void *)mxmlGetCustom(peaksnode);
+	void *peaklist = mzXML_get_peaks(peaksnode, NULL);
 	int size = atoi(mxmlElementGetAttr(peaksnode,"precision"))/8;
 	assert(4 == size || 8 == size);
 	
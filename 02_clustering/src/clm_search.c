@@ -0,0 +1,153 @@
+// clm_search.c
+
+#include <stddef.h>
+#include "clm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+// Below this many points in a row, searches from a cursor step over so few
+// points per query that the scalar loop beats the SIMD ones (test/searchbench:
+// scalar is ahead by 4-6 ns a query at 500-1000 points a scan, the two are
+// level at 2000, and SIMD is ahead by 2-8 ns a query from 5000 up)
+#define SIMD_MIN_POINTS 2000
+
+// Find the span of points in row[from..len) within dist of mz, assuming the
+// row is sorted by mz and ends at len or at the first point with mz == 0
+// Return the index of the first point in the span and set *end to one past the
+// last point (scalar reference implementation)
+int findmzWindow_scalar(const Point *row, int from, int len, double mz,
+		double dist, int *end) {
+	int b;
+
+	for (b = from; b < len; ++b) {
+		if (!row[b].mz) break;
+		if (!(row[b].mz - mz < -dist)) break;
+	}
+	*end = b;
+	for (; *end < len; ++*end) {
+		if (!row[*end].mz) break;
+		if (row[*end].mz - mz > dist) break;
+	}
+	return b;
+}
+
+#ifdef HAVE_X86_SIMD
+// SSE2 version of findmzWindow, comparing two points per step
+__attribute__((target("sse2")))
+int findmzWindow_sse2(const Point *row, int from, int len, double mz,
+		double dist, int *end) {
+	const __m128d vmz = _mm_set1_pd(mz), vlo = _mm_set1_pd(-dist);
+	const __m128d vhi = _mm_set1_pd(dist), vzero = _mm_setzero_pd();
+	int b = from, mask;
+
+	// Lower bound: first point that is not below the window (or terminator)
+	for (; b + 2 <= len; b += 2) {
+		__m128d v = _mm_set_pd(row[b+1].mz, row[b].mz);
+		__m128d d = _mm_sub_pd(v, vmz);
+		mask = _mm_movemask_pd(_mm_or_pd(_mm_cmpnlt_pd(d, vlo),
+					_mm_cmpeq_pd(v, vzero)));
+		if (mask) {
+			b += __builtin_ctz(mask);
+			goto upper;
+		}
+	}
+	for (; b < len; ++b)
+		if (!row[b].mz || !(row[b].mz - mz < -dist)) break;
+
+upper:
+	// Upper bound: first point above the window (or terminator)
+	for (*end = b; *end + 2 <= len; *end += 2) {
+		__m128d v = _mm_set_pd(row[*end+1].mz, row[*end].mz);
+		__m128d d = _mm_sub_pd(v, vmz);
+		mask = _mm_movemask_pd(_mm_or_pd(_mm_cmpgt_pd(d, vhi),
+					_mm_cmpeq_pd(v, vzero)));
+		if (mask) {
+			*end += __builtin_ctz(mask);
+			return b;
+		}
+	}
+	for (; *end < len; ++*end)
+		if (!row[*end].mz || row[*end].mz - mz > dist) break;
+	return b;
+}
+
+// AVX2 version of findmzWindow, comparing four points per step
+__attribute__((target("avx2")))
+int findmzWindow_avx2(const Point *row, int from, int len, double mz,
+		double dist, int *end) {
+	const __m256d vmz = _mm256_set1_pd(mz), vlo = _mm256_set1_pd(-dist);
+	const __m256d vhi = _mm256_set1_pd(dist), vzero = _mm256_setzero_pd();
+	int b = from, mask;
+
+	// Lower bound: first point that is not below the window (or terminator)
+	for (; b + 4 <= len; b += 4) {
+		__m256d v = _mm256_set_pd(row[b+3].mz, row[b+2].mz,
+						row[b+1].mz, row[b].mz);
+		__m256d d = _mm256_sub_pd(v, vmz);
+		mask = _mm256_movemask_pd(_mm256_or_pd(
+					_mm256_cmp_pd(d, vlo, _CMP_NLT_UQ),
+					_mm256_cmp_pd(v, vzero, _CMP_EQ_OQ)));
+		if (mask) {
+			b += __builtin_ctz(mask);
+			goto upper;
+		}
+	}
+	for (; b < len; ++b)
+		if (!row[b].mz || !(row[b].mz - mz < -dist)) break;
+
+upper:
+	// Upper bound: first point above the window (or terminator)
+	for (*end = b; *end + 4 <= len; *end += 4) {
+		__m256d v = _mm256_set_pd(row[*end+3].mz, row[*end+2].mz,
+						row[*end+1].mz, row[*end].mz);
+		__m256d d = _mm256_sub_pd(v, vmz);
+		mask = _mm256_movemask_pd(_mm256_or_pd(
+					_mm256_cmp_pd(d, vhi, _CMP_GT_OQ),
+					_mm256_cmp_pd(v, vzero, _CMP_EQ_OQ)));
+		if (mask) {
+			*end += __builtin_ctz(mask);
+			return b;
+		}
+	}
+	for (; *end < len; ++*end)
+		if (!row[*end].mz || row[*end].mz - mz > dist) break;
+	return b;
+}
+#endif
+
+// Pick the best findmzWindow implementation for this CPU on first call
+static int findmzWindow_init(const Point*, int, int, double, double, int*);
+static int (*findmzWindow_impl)(const Point*, int, int, double, double, int*)
+	= findmzWindow_init;
+
+static int findmzWindow_init(const Point *row, int from, int len, double mz,
+		double dist, int *end) {
+	findmzWindow_impl = findmzWindow_scalar;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) findmzWindow_impl = findmzWindow_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		findmzWindow_impl = findmzWindow_sse2;
+#endif
+	return findmzWindow_impl(row, from, len, mz, dist, end);
+}
+
+// Find the span of points in row[from..len) within dist of mz (see above),
+// using the fastest implementation supported by the CPU
+int findmzWindow(const Point *row, int from, int len, double mz, double dist,
+		int *end) {
+	return findmzWindow_impl(row, from, len, mz, dist, end);
+}
+
+// Find the span of points in row[from..len) within dist of mz (see above),
+// where from is a cursor left by the search for the previous mz of a sorted
+// scan and len is the number of points in the row
+int findmzWindowCursor(const Point *row, int from, int len, double mz,
+		double dist, int *end) {
+	if (len < SIMD_MIN_POINTS)
+		return findmzWindow_scalar(row, from, len, mz, dist, end);
+	return findmzWindow_impl(row, from, len, mz, dist, end);
+}
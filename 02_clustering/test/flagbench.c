@@ -0,0 +1,221 @@
+// flagbench.c
+//
+// Times the clm_flags and clm_points functions across flag table sizes and
+// occupancy levels, reporting ns/op and how the cost scales with table size
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "clm.h"
+
+#define SEED 20130101
+#define FLAGS_PER_COLOR 4 // Average number of flags merged into each color
+#define ROWS 100          // Scans in the matrix used for writeClusters
+#define MIN_TIME 2E7      // Minimum time in ns to repeat each measurement
+
+enum {
+	B_GETNEXT, B_GETLATEST, B_FRESHEN, B_CLEAROLD, B_MERGE, B_WRITE, B_STEP,
+	N_BENCH
+};
+const char *bench_names[N_BENCH] = {"getnextFlag", "getlatestFlags",
+	"freshenFlags", "clearoldFlags", "mergeColors", "writeClusters",
+	"stepPointmatrix"};
+
+int sizes[] = {1000, 4000, 16000, 64000};
+double occupancies[] = {0.1, 0.5, 0.9};
+#define N_SIZES (int)(sizeof(sizes)/sizeof(sizes[0]))
+#define N_OCCS (int)(sizeof(occupancies)/sizeof(occupancies[0]))
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1E9 + ts.tv_nsec;
+}
+
+// Fill flags[] so that a fraction occ of them is in use, FLAGS_PER_COLOR flags
+// to a color on average, with last_seen spread over N_SCANS scans
+void fillFlags(Flag *flags, int len, double occ) {
+	int a, colors = len*occ/FLAGS_PER_COLOR + 1;
+
+	for (a = 0; a < len; ++a) {
+		if ((double)rand()/RAND_MAX < occ) {
+			flags[a].color = rand() % colors;
+			flags[a].last_seen = rand() % N_SCANS;
+		} else {
+			flags[a].color = NO_COLOR;
+			flags[a].last_seen = -1;
+		}
+	}
+}
+
+// Fill the first rows of mtx[][] with sorted points belonging to used flags
+void fillMatrix(Point **mtx, int rows, int cols, Flag *flags, int len) {
+	int a, b, c;
+
+	for (b = 0; b < rows; ++b) {
+		for (c = 0; c < cols; ++c) {
+			for (a = rand() % len; flags[a].last_seen < 0; a = (a+1) % len);
+			mtx[b][c].mz = 100 + c*0.1;
+			mtx[b][c].I = 1 + rand()%100;
+			mtx[b][c].cluster_flag = &flags[a];
+		}
+	}
+}
+
+// Remove cluster files written by writeClusters from cwd
+void removeClusters(void) {
+	DIR *dir = opendir(".");
+	struct dirent *ent;
+
+	if (!dir) infox("Couldn't open bench dir", -3, __FILE__, __LINE__);
+	while ((ent = readdir(dir)) != NULL)
+		if (strstr(ent->d_name, ".clust")) unlink(ent->d_name);
+	closedir(dir);
+}
+
+// Time one benchmark on a table of len flags with occupancy occ
+double timeBench(int bench, int len, double occ) {
+	Flag *flags = malloc(len*sizeof(Flag));
+	Flag *work = malloc(len*sizeof(Flag));
+	Flag *latest = malloc(len*sizeof(Flag));
+	Point **mtx = NULL;
+	double RTs[N_SCANS];
+	Filter none = {INT_MAX, 0, 0, 0, 0};
+	Filter all = {1, 0, 0, 0, 0};
+	long ops = 0;
+	double elapsed = 0;
+	int a, tail, ret = 0;
+
+	if (!flags || !work || !latest)
+		infox("Couldn't allocate flags", -1, __FILE__, __LINE__);
+	fillFlags(flags, len, occ);
+	tail = getlatestFlags(flags, len, latest);
+	for (a = 0; a < N_SCANS; ++a) RTs[a] = a*0.23;
+	if (bench == B_WRITE || bench == B_STEP) {
+		mtx = Pointmatrix(N_SCANS, len/ROWS);
+		if (!mtx) infox("Couldn't allocate matrix", -1, __FILE__, __LINE__);
+		if (bench == B_WRITE) {
+			freshenFlags(flags, len, latest, tail);
+			fillMatrix(mtx, ROWS, len/ROWS, flags, len);
+		}
+	}
+
+	while (elapsed < MIN_TIME) {
+		double start;
+
+		// Work on a copy for functions that modify flags[]
+		memcpy(work, flags, len*sizeof(Flag));
+		switch (bench) {
+			case B_GETNEXT:
+				start = now();
+				for (a = 0; a < 1000; ++a)
+					ret |= getnextFlag(work, len, rand() % len);
+				elapsed += now() - start;
+				ops += 1000;
+				break;
+			case B_GETLATEST:
+				start = now();
+				ret |= getlatestFlags(work, len, latest);
+				elapsed += now() - start;
+				++ops;
+				break;
+			case B_FRESHEN:
+				start = now();
+				ret |= freshenFlags(work, len, latest, tail);
+				elapsed += now() - start;
+				++ops;
+				break;
+			case B_CLEAROLD:
+				start = now();
+				ret |= clearoldFlags(work, len, latest, tail, N_SCANS/2);
+				elapsed += now() - start;
+				++ops;
+				break;
+			case B_MERGE:
+				start = now();
+				for (a = 0; a < 10; ++a)
+					ret |= mergeColors(work, len, &work[rand() % len],
+										rand() % (tail+1));
+				elapsed += now() - start;
+				ops += 10;
+				break;
+			case B_WRITE:
+				// Filter everything out, then write everything
+				start = now();
+				ret |= writeClusters(mtx, ROWS, len/ROWS, latest, tail,
+										N_SCANS, RTs, 0, &none, NULL);
+				elapsed += now() - start;
+				++ops;
+				start = now();
+				ret |= writeClusters(mtx, ROWS, len/ROWS, latest, tail,
+										N_SCANS, RTs, 0, &all, NULL);
+				elapsed += now() - start;
+				++ops;
+				removeClusters();
+				break;
+			case B_STEP:
+				start = now();
+				ret |= stepPointmatrix(mtx, N_SCANS, len/ROWS, N_SCANS/3);
+				elapsed += now() - start;
+				++ops;
+				break;
+		}
+	}
+	if (ret < 0) infox("Benchmarked function failed", -2, __FILE__, __LINE__);
+
+	if (mtx) freePointmatrix(mtx);
+	free(flags);
+	free(work);
+	free(latest);
+	return elapsed / ops;
+}
+
+int main(int argc, char** argv)
+{
+	double ns[N_BENCH][N_OCCS][N_SIZES];
+	int bench, o, s;
+
+	// Run in a scratch dir since writeClusters writes to cwd
+	char dir[] = "/tmp/flagbenchXXXXXX";
+	if (!mkdtemp(dir) || chdir(dir))
+		infox("Couldn't create bench dir", -3, __FILE__, __LINE__);
+
+	printf("%-16s %5s", "ns/op", "occ");
+	for (s = 0; s < N_SIZES; ++s) printf(" %12d", sizes[s]);
+	printf("\n");
+
+	for (bench = 0; bench < N_BENCH; ++bench) {
+		for (o = 0; o < N_OCCS; ++o) {
+			printf("%-16s %5.2f", bench_names[bench], occupancies[o]);
+			for (s = 0; s < N_SIZES; ++s) {
+				srand(SEED);
+				ns[bench][o][s] = timeBench(bench, sizes[s], occupancies[o]);
+				printf(" %12.1f", ns[bench][o][s]);
+				fflush(stdout);
+			}
+			printf("\n");
+		}
+	}
+
+	// Scaling exponent k in time ~ size^k between successive sizes
+	printf("\n%-16s %5s", "scaling", "occ");
+	for (s = 1; s < N_SIZES; ++s) printf(" %5d->%-6d", sizes[s-1], sizes[s]);
+	printf("\n");
+	for (bench = 0; bench < N_BENCH; ++bench) {
+		for (o = 0; o < N_OCCS; ++o) {
+			printf("%-16s %5.2f", bench_names[bench], occupancies[o]);
+			for (s = 1; s < N_SIZES; ++s)
+				printf(" %12.2f", log(ns[bench][o][s]/ns[bench][o][s-1]) /
+									log((double)sizes[s]/sizes[s-1]));
+			printf("\n");
+		}
+	}
+
+	if (chdir("/tmp") == 0) rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,148 @@
+// searchbench.c
+//
+// Times the neighbour m/z window search in clm at realistic peak densities
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "clm.h"
+
+#define MIN_MZ 100.0
+#define MAX_MZ 2000.0
+#define TOF_BINS 400000 // Approximate number of TOF bins between MIN/MAX_MZ
+#define SEED 12345
+#define REPS 5
+
+typedef int (*searchfn)(const Point*, int, int, double, double, int*);
+
+// The branchy loop that used to find neighbours in clm_main.c
+int findmzWindow_loop(const Point *row, int from, int len, double mz,
+		double dist, int *end) {
+	int b, first;
+
+	for (b = from; b < len; ++b) {
+		if (!row[b].mz) break;
+		if (row[b].mz - mz < -dist) continue;
+		break;
+	}
+	first = b;
+	for (; b < len; ++b) {
+		if (!row[b].mz) break;
+		if (row[b].mz - mz > dist) break;
+	}
+	*end = b;
+	return first;
+}
+
+// Fill row with about n sorted points lying on a uniform sqrt(mz) grid,
+// returning how many
+int fillRow(Point *row, int n, int cols) {
+	double t0 = sqrt(MIN_MZ), t_gap = (sqrt(MAX_MZ)-t0)/TOF_BINS;
+	int a = 0, k;
+
+	memset(row, 0, cols*sizeof(Point));
+	for (k = 0; k < TOF_BINS && a < n; ++k) {
+		// Keep each bin with the probability needed to get about n points
+		if ((double)rand()/RAND_MAX >= (double)n/TOF_BINS) continue;
+		row[a].mz = (t0 + k*t_gap)*(t0 + k*t_gap);
+		row[a].I = 1 + rand()%100;
+		++a;
+	}
+	return a;
+}
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1E9 + ts.tv_nsec;
+}
+
+// Time queries for every point in curr against prev, returning ns per query
+// If use_cursor, each search starts where the previous one did as in clm_main.c
+double timeSearch(searchfn find, const Point *prev, int prev_len,
+		const Point *curr, int cols, int use_cursor, long *found) {
+	double best = 0;
+	int rep, b;
+
+	for (rep = 0; rep < REPS; ++rep) {
+		int cursor = 0, end, queries = 0;
+		long hits = 0;
+		double start = now();
+		for (b = 0; b < cols && curr[b].mz; ++b) {
+			int first = find(prev, use_cursor ? cursor : 0, prev_len,
+								curr[b].mz, MZ_DIST, &end);
+			if (use_cursor) cursor = first;
+			hits += end - first;
+			++queries;
+		}
+		double ns = (now() - start) / (queries ? queries : 1);
+		if (rep == 0 || ns < best) best = ns;
+		*found = hits;
+	}
+	return best;
+}
+
+int main(int argc, char** argv)
+{
+	int densities[] = {500, 1000, 2000, 3000, 5000, 10000, 20000};
+	struct {
+		const char *name;
+		searchfn find;
+		int use_cursor;
+	} impls[] = {
+		{"loop", findmzWindow_loop, 0},
+		{"scalar", findmzWindow_scalar, 0},
+#if defined(__x86_64__) || defined(__i386__)
+		{"sse2", findmzWindow_sse2, 0},
+		{"avx2", findmzWindow_avx2, 0},
+#endif
+		{"loop+cursor", findmzWindow_loop, 1},
+		{"scalar+cursor", findmzWindow_scalar, 1},
+		{"best+cursor", findmzWindow, 1},
+		{"auto+cursor", findmzWindowCursor, 1},
+	};
+	int n_impls = sizeof(impls)/sizeof(impls[0]);
+	Point *prev = malloc(N_MZPOINTS*sizeof(Point));
+	Point *curr = malloc(N_MZPOINTS*sizeof(Point));
+	int a, d;
+
+	if (!prev || !curr)
+		infox("Couldn't allocate rows", -1, __FILE__, __LINE__);
+
+	printf("%-12s", "points/scan");
+	for (a = 0; a < n_impls; ++a) printf(" %12s", impls[a].name);
+	printf("   (ns/query)\n");
+
+	srand(SEED);
+	for (d = 0; d < sizeof(densities)/sizeof(densities[0]); ++d) {
+		long ref = -1, found;
+		int prev_len;
+
+		prev_len = fillRow(prev, densities[d], N_MZPOINTS);
+		fillRow(curr, densities[d], N_MZPOINTS);
+
+		printf("%-12d", densities[d]);
+		for (a = 0; a < n_impls; ++a) {
+#if defined(__x86_64__) || defined(__i386__)
+			if (impls[a].find == findmzWindow_avx2 &&
+				!__builtin_cpu_supports("avx2")) {
+				printf(" %12s", "n/a");
+				continue;
+			}
+#endif
+			double ns = timeSearch(impls[a].find, prev, prev_len, curr,
+									N_MZPOINTS, impls[a].use_cursor, &found);
+			if (ref < 0) ref = found;
+			else if (found != ref)
+				infox("Implementations disagree", -2, __FILE__, __LINE__);
+			printf(" %12.1f", ns);
+		}
+		printf("\n");
+	}
+
+	free(prev);
+	free(curr);
+	return 0;
+}
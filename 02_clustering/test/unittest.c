@@ -1,6 +1,8 @@
 // unittest.c
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "clm.h"
 
 #define BUFLEN 100
@@ -210,6 +212,80 @@ void testgetlatestFlags(Flag *flags, int len) {
 	printf("getlatestFlag(f,%d,l) passed\n",len);
 }
 
+// Tests clusterColor and clusterFilename
+void testclusterColor(void) {
+	char errbuf[BUFLEN], fn[CLUST_FN_LEN];
+	long long c1, c2;
+
+	// Check failure on invalid parameters
+	if (clusterColor(-1, 100.0, NO_COLOR) >= 0 ||
+		clusterColor(0, -1.0, NO_COLOR) >= 0)
+		infox("clusterColor succeeded when it should fail", -21, __FILE__,
+				__LINE__);
+
+	// Check colors order by scan, then mz
+	c1 = clusterColor(10, 1999.9999, NO_COLOR);
+	c2 = clusterColor(11, 100.0, NO_COLOR);
+	if (c1 >= c2 || clusterColor(10, 100.0, NO_COLOR) >= c1)
+		infox("clusterColor out of order", -22, __FILE__, __LINE__);
+
+	// Check colors stay unique within an m/z bin
+	c1 = clusterColor(10, 500.00001, NO_COLOR);
+	c2 = clusterColor(10, 500.00002, c1);
+	if (c2 <= c1)
+		infox("clusterColor repeated color", -23, __FILE__, __LINE__);
+
+	clusterFilename(fn, clusterColor(12, 456.7891, NO_COLOR));
+	if (strcmp(fn, "000012_004567891.clust")) {
+		sprintf(errbuf, "clusterFilename gave %s", fn);
+		infox(errbuf, -24, __FILE__, __LINE__);
+	}
+	printf("clusterColor passed\n");
+}
+
+// Tests a findmzWindow implementation against the original neighbour loop on
+// a sorted row of len points followed by a zero terminator (row preallocated)
+void testfindmzWindow(int (*find)(const Point*, int, int, double, double, int*),
+		const char *name, Point *row, int len, int cols) {
+	char errbuf[BUFLEN];
+	double dist = 0.02;
+	int a,b,first,end,from;
+
+	// Fill row with ascending mz values, sometimes closer together than dist
+	srand(len);
+	for (a=0; a<cols; ++a) {
+		row[a].mz = (a < len) ? 100 + a*0.03 + (rand()%100)*0.0002 : 0;
+		row[a].I = a;
+		row[a].cluster_flag = NULL;
+	}
+
+	for (a=0; a<=len; ++a) {
+		// Query at, between, below and above existing points
+		double mz = (a < len) ? row[a].mz + ((a%3)-1)*0.011 : 100+len*0.03+1;
+		for (from=0; from<=a && from<=len; from+=(a/4+1)) {
+			// Reference is the loop that used to be in clm_main.c
+			for (b=from; b<cols; ++b) {
+				if (!row[b].mz) break;
+				if (row[b].mz - mz < -dist) continue;
+				break;
+			}
+			int ref_first = b;
+			for (; b<cols; ++b) {
+				if (!row[b].mz) break;
+				if (row[b].mz - mz > dist) break;
+			}
+
+			first = find(row, from, cols, mz, dist, &end);
+			if (first != ref_first || end != b) {
+				sprintf(errbuf, "%s(r,%d,%d,%.4f) gave [%d,%d) not [%d,%d)",
+						name, from, cols, mz, first, end, ref_first, b);
+				infox(errbuf, -20, __FILE__, __LINE__);
+			}
+		}
+	}
+	printf("%s(r,%d,%d) passed\n",name,len,cols);
+}
+
 int main(int argc, char** argv)
 {
 	int rows = 50, cols = 100, len = 1000;
@@ -246,6 +322,22 @@ int main(int argc, char** argv)
 	testgetlatestFlags(flags, -1);
 	testgetlatestFlags(flags, len);
 
+	testclusterColor();
+
+	Point row[cols];
+	for (int a=0; a<=cols; a+=cols/4) {
+		testfindmzWindow(findmzWindow_scalar, "findmzWindow_scalar", row, a,
+						cols);
+		testfindmzWindow(findmzWindow, "findmzWindow", row, a, cols);
+		testfindmzWindow(findmzWindowCursor, "findmzWindowCursor", row, a,
+						cols);
+#if defined(__x86_64__) || defined(__i386__)
+		testfindmzWindow(findmzWindow_sse2, "findmzWindow_sse2", row, a, cols);
+		if (__builtin_cpu_supports("avx2"))
+			testfindmzWindow(findmzWindow_avx2,"findmzWindow_avx2",row,a,cols);
+#endif
+	}
+
 	printf("All tests passed\n");
 	return 0;
 }
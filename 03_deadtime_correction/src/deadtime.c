@@ -18,6 +18,7 @@
 #include <math.h>
 #include <assert.h>
 #include "mxmlmzXML.h"
+#include "mzXMLpull.h"
 
 typedef struct {
 	float mz, I;
@@ -28,12 +29,14 @@ typedef struct {
 } mzI_64;
 
 void parse_command_line(int, char**);
-void correct_deadtime(mxml_node_t *);
+void write_failed(void);
+void correct_deadtime(void *, long, int);
 int compare_mz_32(const void *, const void *);
 int compare_mz_64(const void *, const void *);
 
 // Global command line parameters with default values
-FILE *input = NULL, *output = NULL;
+mzXML_pull *input = NULL;
+FILE *output = NULL;
 
 double nedeadtime = DEFAULT_NEDEADTIME * 1E-9;
 double edeadtime = DEFAULT_EDEADTIME * 1E-9;
@@ -46,25 +49,43 @@ double A; // Proportionality const : t = A * sqrt(m/z), A = L/sqrt(2*(e/amu)*V)
 double highest_t = 0.0;
 
 int main(int argc, char** argv) {
-	mxml_node_t *tree = NULL, *node = NULL;
+	mzXML_index index = {0};
+	mzXML_scan *scan;
 
 	parse_command_line(argc, argv);
 	A = length / sqrt( 2 * e_amu * voltage );
 	pulses = scantime / cycletime;
 
-	mxmlSetCustomHandlers(mzXML_load_custom,mzXML_save_custom);
-	tree = mxmlLoadFile(NULL,input,mzXML_load_cb);
-	fclose(input);
-
-	mxml_index_t *index = mxmlIndexNew(tree,"scan",NULL);
-	mxmlIndexReset(index);
-	while ((node = mxmlIndexEnum(index)) != NULL) {
-		correct_deadtime(node);
+	// Copy the file through verbatim, replacing only the peak lists
+	while ((scan = mzXML_pull_next(input)) != NULL) {
+		long peaks_length;
+		void *peaklist;
+		char *coded;
+
+		if (mzXML_pull_copy(input, output, scan->offset)) write_failed();
+		mzXML_index_add(&index, scan->num, ftell(output));
+		if (!scan->payload) continue;
+
+		peaklist = mzXML_decode(scan->payload, scan->payload_len, scan->compression,
+			scan->zlib_len, scan->precision, &peaks_length);
+		if (!peaklist) {
+			fprintf(stderr,"Peak list decompression failed.\n");
+			exit( 131 );
+		}
+		correct_deadtime(peaklist, peaks_length, scan->precision/8);
+		coded = mzXML_encode(peaklist, peaks_length, scan->compression, scan->precision);
+
+		if (mzXML_pull_copy(input, output, scan->payload - input->data) ||
+			fputs(coded, output) == EOF) write_failed();
+		mzXML_pull_skip(input, scan->payload - input->data + scan->payload_len);
+		free(peaklist);
+		free(coded);
 	}
 
-	// Write out mzXML
-	mxmlSetWrapMargin(0);
-	mxmlSaveFile(tree, output, mzXML_whitespace_cb);
+	// Write a new scan index, as peak list lengths change
+	if (mzXML_pull_copy(input, output, input->tail)) write_failed();
+	if (input->tail < input->size && (mzXML_write_index(&index, output) ||
+		mzXML_write_sha1(output) || fputs("</mzXML>\n", output) == EOF)) write_failed();
 
 	// Print out warnings
 	if (highest_t > cycletime)
@@ -73,11 +94,17 @@ int main(int argc, char** argv) {
 
 	// Clean up
 	if (output) fclose(output);
-	mxmlIndexDelete(index);
-	mxmlDelete(tree);
+	free(index.nums);
+	free(index.offsets);
+	mzXML_pull_close(input);
 	return 0;
 }
 
+void write_failed(void) {
+	fprintf(stderr,"Could not write output mzXML\n");
+	exit(9);
+}
+
 // Parse and validate command line, storing parameters and opening files
 void parse_command_line(int argc, char** argv) {
 	int opt;
@@ -121,17 +148,17 @@ void parse_command_line(int argc, char** argv) {
 		printf("\nNon-extending deadtime should be greater than extending deadtime.\n");
 		exit (1);
 	} else {
-		input = openfile(argv[optind],"r");
-		output = openfile(argv[++optind],"w");
+		if (!(input = mzXML_pull_open(argv[optind]))) {
+			fprintf(stderr,"Could not open %s\n",argv[optind]);
+			exit(8);
+		}
+		output = openfile(argv[++optind],"w+"); // Read back for sha1
 	}
 }
 
-// Correct peaklist of scan node for deadtimes
-void correct_deadtime(mxml_node_t *node) {
-	mxml_node_t *peaksnode = mxmlFindElement(node, node, "peaks", NULL, NULL, MXML_DESCEND);
-	int peaks = atoi(mxmlElementGetAttr(node, "peaksCount"));
-	void *peaklist = (void *)mxmlGetCustom(peaksnode);
-	int size = atoi(mxmlElementGetAttr(peaksnode,"precision"))/8;
+// Correct peaklist of length bytes with m/z-I pairs of size bytes each
+void correct_deadtime(void *peaklist, long length, int size) {
+	long peaks = length / (2*size);
 	assert(4 == size || 8 == size);
 
 	struct {
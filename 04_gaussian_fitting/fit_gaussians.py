@@ -27,7 +27,7 @@ def sumsquares(func):
 
 def main():
 	files = [glob.glob(g) for g in sys.argv[1:]]
-	files = [f for f in sum(files,[]) if re.match('\d{6}\.clust$', basename(f))]
+	files = [f for f in sum(files,[]) if re.match('\d{6}_\d{9}\.clust$', basename(f))]
 	if not files:
 		print 'Usage: ' + basename(__file__) + ' <cluster> ...'
 		return -1
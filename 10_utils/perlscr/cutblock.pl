@@ -17,9 +17,13 @@ foreach $a (1 .. ($blocks-1)) {
 	$mz[$a] = ($min_t + $inc_t * $a)**2;
 }
 
-foreach $a (0 .. ($blocks-1)) {
-	$cmdline = $preprocess . " -m " . $mz[$a] .  " -M " . $mz[$a+1] . " ";
-	$cmdline = $cmdline . $ARGV[0] . " " . $ARGV[0] . "." . sprintf('%04u',$a);
-	print $cmdline . "\n";
-	system($cmdline);
+# Cut all blocks in one pass, written to <mzXML>.0000, <mzXML>.0001, ...
+$cmdline = $preprocess . " -m " . $mz[0] . " -M " . $mz[$blocks];
+if ($blocks > 1) {
+	$cmdline = $cmdline . " --split mz:" . join(",", @mz[1 .. ($blocks-1)]);
+	$cmdline = $cmdline . " " . $ARGV[0] . " " . $ARGV[0];
+} else {
+	$cmdline = $cmdline . " " . $ARGV[0] . " " . $ARGV[0] . ".0000";
 }
+print $cmdline . "\n";
+system($cmdline);
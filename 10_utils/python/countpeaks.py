@@ -22,7 +22,7 @@ def main():
 	files = []
 	for g in sys.argv[1:]:
 		files += glob.glob(g)
-	files = [f for f in files if re.match('^\d{6}\.clust$', basename(f))]
+	files = [f for f in files if re.match('^\d{6}_\d{9}\.clust$', basename(f))]
 	if not files:
 		print 'Usage: ' + basename(__file__) + ' <cluster> ...'
 		return -1
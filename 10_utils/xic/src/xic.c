@@ -0,0 +1,333 @@
+//  xic.c
+//
+//  Copyright 2012 David Khoo <davidk@bii.a-star.edu.sg>
+//
+//  Extracts ion chromatograms for many m/z targets in one pass over mzXML
+
+#define DEFAULT_SCAN_TYPE "Full"
+#define DEFAULT_TOLERANCE 0.05 // in u/e
+#define AHEAD_PER_THREAD 2 // Scans read ahead per decode thread
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <float.h>
+#include <getopt.h>
+#include "mxmlmzXML.h"
+#include "mzXMLreader.h"
+
+typedef struct {
+	float mz, I;
+} mzI_32;
+
+typedef struct {
+	double mz, I;
+} mzI_64;
+
+// An m/z window to extract, summing I over low <= m/z <= high
+typedef struct {
+	double mz, tolerance, low, high;
+	int column; // Position in the targets file
+} target;
+
+void parse_command_line(int, char**);
+void read_targets(const char *);
+mxml_node_t *next_scan(void);
+void read_failed(long);
+void sweep_scan(mxml_node_t *);
+void write_row(unsigned int);
+int compare_target(const void *, const void *);
+int compare_mz(const void *, const void *);
+void usage(char**);
+
+// Global command line parameters with default values
+char *inputname = NULL, *outputname = NULL;
+const char *scan_type = DEFAULT_SCAN_TYPE;
+double min_t = 0, max_t = DBL_MAX, default_tolerance = DEFAULT_TOLERANCE;
+bool verbose = false;
+int n_threads = 0;
+
+// Global run state
+target *targets = NULL; // Sorted by low edge
+int n_targets = 0;
+mzXML_reader *reader = NULL;
+long next = 0; // Next scan in the index to consider
+bool done = false; // Past the last scan or the RT window
+FILE *csv = NULL, *bin = NULL;
+double *row = NULL; // RT, TIC, base peak m/z and I, then I of each target
+mzI_64 *peaks = NULL; // Scratch peak list of the current scan
+long peaks_size = 0;
+
+int main(int argc, char** argv) {
+	mxml_node_t **ahead, *scan;
+	int max_ahead = 1, head = 0, n_ahead = 0;
+	unsigned int n_scans = 0;
+
+	parse_command_line(argc, argv);
+
+	// Decode peaks on worker threads while enough scans are read ahead
+	if (mzXML_set_threads(n_threads)) {
+		fprintf(stderr,"Could not start %d decode threads\n",n_threads);
+		exit(10);
+	}
+	if (n_threads > 0) max_ahead = AHEAD_PER_THREAD * n_threads;
+	ahead = malloc(max_ahead * sizeof(mxml_node_t *));
+	mxmlSetCustomHandlers(mzXML_load_custom,mzXML_save_custom);
+
+	if (!(reader = mzXML_open(inputname))) {
+		fprintf(stderr,"Could not read scans from %s\n",inputname);
+		exit(8);
+	}
+	if (verbose) printf("Indexed %ld scans in %s\n", reader->n, inputname);
+	if (min_t > 0) next = mzXML_find_time(reader, min_t);
+
+	// CSV starts with a line naming the columns
+	int *order = malloc(n_targets * sizeof(int));
+	for (int j = 0; j < n_targets; ++j) order[targets[j].column] = j;
+	fprintf(csv,"num RT TIC basePeakMz basePeakIntensity");
+	for (int i = 0; i < n_targets; ++i)
+		fprintf(csv," %.4f+-%.4f",targets[order[i]].mz,targets[order[i]].tolerance);
+	fprintf(csv,"\n");
+	free(order);
+	row = malloc((4 + n_targets) * sizeof(double));
+
+	// Sweep scans in order once the read ahead queue is full
+	while ((scan = next_scan()) || n_ahead > 0) {
+		if (scan) {
+			ahead[(head + n_ahead++) % max_ahead] = scan;
+			if (n_ahead < max_ahead) continue;
+		}
+		scan = ahead[head];
+		head = (head + 1) % max_ahead;
+		--n_ahead;
+
+		sweep_scan(scan);
+		write_row(atoi(mxmlElementGetAttr(scan,"num")));
+		mxmlDelete(scan);
+		++n_scans;
+		if (verbose) printf("\rExtracted scan %u", n_scans);
+	}
+	if (verbose) printf("\nExtracted %d chromatograms over %u scans\n", n_targets, n_scans);
+
+	if (fclose(csv) || fclose(bin)) {
+		fprintf(stderr,"Could not write %s.csv or %s.bin\n",outputname,outputname);
+		exit(9);
+	}
+
+	// Clean up
+	mzXML_close(reader);
+	mzXML_set_threads(0);
+	free(ahead);
+	free(row);
+	free(peaks);
+	free(targets);
+	return 0;
+}
+
+// Read the next scan of the right scanType in the RT window, or return NULL
+// once there are no more
+// Only the start tag is read for scans that are passed over. A scan that
+// cannot be read or parsed ends the run, rather than the input.
+mxml_node_t *next_scan(void) {
+	while (!done && next < reader->n) {
+		mxml_node_t *tag = mzXML_read_tag(reader, next), *scan;
+		if (!tag) read_failed(next);
+
+		const char *type = mxmlElementGetAttr(tag,"scanType");
+		const char *t_str = mxmlElementGetAttr(tag,"retentionTime");
+		double t = t_str ? xsduration_to_s(t_str) : 0;
+		bool wanted = type && !strcmp(type, scan_type) && t >= min_t;
+		if (t > max_t) done = true; // Retention times increase through the file
+		mxmlDelete(tag);
+
+		long i = next++;
+		if (done) break;
+		if (!wanted) continue;
+		if (!(scan = mzXML_read_scan(reader, i))) read_failed(i);
+		return scan;
+	}
+	done = true;
+	return NULL;
+}
+
+// Report that scan i of the index could not be read, and exit
+void read_failed(long i) {
+	fprintf(stderr,"Could not read scan at offset %ld of %s\n",reader->offsets[i],inputname);
+	exit(8);
+}
+
+// Sum the peaks of a scan into row, along with its TIC and base peak
+// The peak list and the targets are both sorted by m/z, so one sweep finds
+// every peak in every target window. As targets are taken in order of low
+// edge, the first peak at or above each low edge only ever moves forward.
+void sweep_scan(mxml_node_t *scan) {
+	mxml_node_t *peaksnode = mxmlFindElement(scan, scan, "peaks", NULL, NULL, MXML_DESCEND_FIRST);
+	long length = 0, n;
+	void *data = peaksnode ? mzXML_get_peaks(peaksnode, &length) : NULL;
+	bool sorted = true;
+
+	row[0] = xsduration_to_s(mxmlElementGetAttr(scan,"retentionTime"));
+	row[1] = row[2] = row[3] = 0;
+
+	// Take the peak list in double precision, sorting it if need be
+	if (data && !strcmp(mxmlElementGetAttr(peaksnode,"precision"),"32")) {
+		n = length / sizeof(mzI_32);
+		if (n > peaks_size) peaks = realloc(peaks, (peaks_size = n) * sizeof(mzI_64));
+		for (long i = 0; i < n; ++i) {
+			peaks[i].mz = ((mzI_32*)data)[i].mz;
+			peaks[i].I = ((mzI_32*)data)[i].I;
+		}
+	} else {
+		n = length / sizeof(mzI_64);
+		if (n > peaks_size) peaks = realloc(peaks, (peaks_size = n) * sizeof(mzI_64));
+		if (n > 0) memcpy(peaks, data, n * sizeof(mzI_64));
+	}
+	for (long i = 0; i < n; ++i) {
+		row[1] += peaks[i].I;
+		if (peaks[i].I > row[3]) {
+			row[2] = peaks[i].mz;
+			row[3] = peaks[i].I;
+		}
+		if (i > 0 && peaks[i].mz < peaks[i-1].mz) sorted = false;
+	}
+	if (!sorted) qsort(peaks, n, sizeof(mzI_64), compare_mz);
+
+	long first = 0;
+	for (int j = 0; j < n_targets; ++j) {
+		target *t = &targets[j];
+		double sum = 0;
+
+		while (first < n && peaks[first].mz < t->low) ++first;
+		for (long i = first; i < n && peaks[i].mz <= t->high; ++i) sum += peaks[i].I;
+		row[4 + t->column] = sum;
+	}
+}
+
+// Write the row of a scan to the CSV and binary matrices
+void write_row(unsigned int num) {
+	fprintf(csv,"%u %.3f %.3f %.4f %.3f", num, row[0], row[1], row[2], row[3]);
+	for (int i = 0; i < n_targets; ++i) fprintf(csv," %.3f",row[4 + i]);
+	fprintf(csv,"\n");
+	if (fwrite(row, sizeof(double), 4 + n_targets, bin) != 4 + n_targets) {
+		fprintf(stderr,"Could not write %s.bin\n",outputname);
+		exit(9);
+	}
+}
+
+// Read targets, one "m/z [tolerance]" per line, and sort them by low edge
+// Blank lines and lines starting with # are skipped
+void read_targets(const char *name) {
+	FILE *fp = openfile(name,"r");
+	char line[256];
+	int size = 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		double mz, tolerance = default_tolerance;
+		int fields = sscanf(line, "%lf %lf", &mz, &tolerance);
+		if (line[0] == '#' || fields < 1) continue;
+
+		if (n_targets == size) {
+			size = size ? 2 * size : 1024;
+			targets = realloc(targets, size * sizeof(target));
+		}
+		target *t = &targets[n_targets];
+		t->mz = mz;
+		t->tolerance = tolerance;
+		t->low = mz - tolerance;
+		t->high = mz + tolerance;
+		t->column = n_targets++;
+	}
+	fclose(fp);
+	qsort(targets, n_targets, sizeof(target), compare_target);
+}
+
+// Compare targets by low edge, then by position in the targets file
+int compare_target(const void *a, const void *b) {
+	const target *ta = a, *tb = b;
+
+	if (ta->low < tb->low) return -1;
+	if (ta->low > tb->low) return 1;
+	return ta->column - tb->column;
+}
+
+int compare_mz(const void *a, const void *b) {
+	double mz_a = ((const mzI_64 *)a)->mz, mz_b = ((const mzI_64 *)b)->mz;
+
+	return (mz_a > mz_b) - (mz_a < mz_b);
+}
+
+// Parse and validate command line, store params and open files
+void parse_command_line(int argc, char** argv) {
+	int opt;
+
+	n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "s:t:T:d:j:v")) != -1) {
+		switch (opt) {
+			case 's':
+				scan_type = optarg;
+				break;
+			case 't':
+				min_t = atof(optarg);
+				break;
+			case 'T':
+				max_t = atof(optarg);
+				break;
+			case 'd':
+				default_tolerance = atof(optarg);
+				break;
+			case 'j':
+				n_threads = atoi(optarg);
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (argc - optind != 3) usage(argv);
+	inputname = argv[optind];
+	read_targets(argv[optind + 1]);
+	if (n_targets == 0) {
+		fprintf(stderr,"No targets in %s\n",argv[optind + 1]);
+		exit(1);
+	}
+	outputname = argv[optind + 2];
+
+	char *name = malloc(strlen(outputname) + 5);
+	sprintf(name, "%s.csv", outputname);
+	csv = openfile(name,"w");
+	sprintf(name, "%s.bin", outputname);
+	bin = openfile(name,"w");
+	free(name);
+
+	if (verbose) {
+		printf("Reading from %s\n", inputname);
+		printf("Extracting %d targets from scans of \"%s\" type", n_targets, scan_type);
+		if (min_t != 0 && max_t != DBL_MAX) printf(" with %.3f < RT < %.3f", min_t, max_t);
+		else if (min_t != 0) printf (" with RT > %.3f", min_t);
+		else if (max_t != DBL_MAX) printf(" with RT < %.3f", max_t);
+		printf("\n");
+		printf("Writing chromatograms to %s.csv and %s.bin\n", outputname, outputname);
+		if (n_threads > 0) printf("Decoding peaks on %d threads\n", n_threads);
+		printf("\n");
+	}
+}
+
+void usage(char** argv) {
+	printf("Usage: %s [flags] inname targets outname\n",argv[0]);
+	printf("\n");
+	printf("targets has one \"m/z [tolerance]\" per line. Writes outname.csv with a\n");
+	printf("line per scan of \"num RT TIC basePeakMz basePeakIntensity\" and the summed\n");
+	printf("I of each target, in targets order, and outname.bin with the same rows\n");
+	printf("(less num) as doubles in host byteorder.\n");
+	printf("\n");
+	printf("Flags: -s <scanType> Use scans of this scanType (default %s)\n", DEFAULT_SCAN_TYPE);
+	printf("       -t <time>     Minimum retentionTime in s (default 0)\n");
+	printf("       -T <time>     Maximum retentionTime in s (default max)\n");
+	printf("       -d <m/z>      Tolerance of targets without one (default %.3f)\n", DEFAULT_TOLERANCE);
+	printf("       -j <n>        Decode peaks on n threads (default all cores)\n");
+	printf("       -v            Verbose output (default off)\n");
+	exit (1);
+}
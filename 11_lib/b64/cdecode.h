@@ -25,4 +25,11 @@ int base64_decode_value(char value_in);
 
 int base64_decode_block(const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in);
 
+/* Fixed implementations of base64_decode_block, for testing */
+int base64_decode_block_scalar(const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in);
+#if defined(__x86_64__) || defined(__i386__)
+int base64_decode_block_ssse3(const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in);
+int base64_decode_block_avx2(const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in);
+#endif
+
 #endif /* BASE64_CDECODE_H */
@@ -28,4 +28,11 @@ int base64_encode_block(const char* plaintext_in, int length_in, char* code_out,
 
 int base64_encode_blockend(char* code_out, base64_encodestate* state_in);
 
+/* Fixed implementations of base64_encode_block, for testing */
+int base64_encode_block_scalar(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in);
+#if defined(__x86_64__) || defined(__i386__)
+int base64_encode_block_ssse3(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in);
+int base64_encode_block_avx2(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in);
+#endif
+
 #endif /* BASE64_CENCODE_H */
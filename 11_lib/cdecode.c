@@ -5,8 +5,14 @@ This is part of the libb64 project, and has been placed in the public domain.
 For details, see http://sourceforge.net/projects/libb64
 */
 
+#include <string.h>
 #include "b64/cdecode.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
 int base64_decode_value(char value_in)
 {
 	static const char decoding[] = {62,-1,-1,-1,63,52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-2,-1,-1,-1,0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,-1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51};
@@ -22,7 +28,8 @@ void base64_init_decodestate(base64_decodestate* state_in)
 	state_in->plainchar = 0;
 }
 
-int base64_decode_block(const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in)
+/* Byte-at-a-time state machine, used for anything the vector kernels skip */
+int base64_decode_block_scalar(const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in)
 {
 	const char* codechar = code_in;
 	char* plainchar = plaintext_out;
@@ -86,3 +93,173 @@ int base64_decode_block(const char* code_in, const int length_in, char* plaintex
 	return plainchar - plaintext_out;
 }
 
+
+/* Vector kernels decode whole chunks of valid base64 characters, returning
+   the number of characters consumed. They stop at the first chunk holding
+   anything else (whitespace, padding), which the state machine then handles. */
+
+static int base64_decode_none(const char* code_in, int length_in, char* plaintext_out)
+{
+	return 0;
+}
+
+#ifdef HAVE_X86_SIMD
+/* Map 16 base64 characters to their 6-bit values, or return 0 if any of
+   them is not in the base64 alphabet */
+__attribute__((target("ssse3")))
+static inline int base64_values_ssse3(__m128i in, __m128i* values)
+{
+	const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(in, _mm_set1_epi8('Z' + 1)));
+	const __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(in, _mm_set1_epi8('z' + 1)));
+	const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(in, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(in, _mm_set1_epi8('9' + 1)));
+	const __m128i plus = _mm_cmpeq_epi8(in, _mm_set1_epi8('+'));
+	const __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+	__m128i shift;
+
+	if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(_mm_or_si128(digit, plus), slash))) != 0xFFFF)
+		return 0;
+	shift = _mm_or_si128(_mm_and_si128(upper, _mm_set1_epi8(-'A')), _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+	shift = _mm_or_si128(shift, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+	shift = _mm_or_si128(shift, _mm_and_si128(plus, _mm_set1_epi8(62 - '+')));
+	shift = _mm_or_si128(shift, _mm_and_si128(slash, _mm_set1_epi8(63 - '/')));
+	*values = _mm_add_epi8(in, shift);
+	return 1;
+}
+
+/* Store the low 12 bytes of a vector */
+static inline void base64_store12(__m128i packed, char* out)
+{
+	int tail = _mm_cvtsi128_si32(_mm_srli_si128(packed, 8));
+
+	_mm_storel_epi64((__m128i*)out, packed);
+	memcpy(out + 8, &tail, 4);
+}
+
+/* Pack four 6-bit values per 32-bit lane into 12 output bytes */
+__attribute__((target("ssse3")))
+static inline void base64_pack_ssse3(__m128i values, char* out)
+{
+	__m128i packed = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+
+	packed = _mm_madd_epi16(packed, _mm_set1_epi32(0x00011000));
+	packed = _mm_shuffle_epi8(packed, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	base64_store12(packed, out);
+}
+
+/* SSSE3 kernel, 16 characters to 12 bytes per step */
+__attribute__((target("ssse3")))
+static int base64_decode_ssse3(const char* code_in, int length_in, char* plaintext_out)
+{
+	int n;
+	__m128i values;
+
+	for (n = 0; n + 16 <= length_in; n += 16)
+	{
+		if (!base64_values_ssse3(_mm_loadu_si128((const __m128i*)(code_in + n)), &values)) break;
+		base64_pack_ssse3(values, plaintext_out + n / 4 * 3);
+	}
+	return n;
+}
+
+/* AVX2 kernel, 32 characters to 24 bytes per step */
+__attribute__((target("avx2")))
+static int base64_decode_avx2(const char* code_in, int length_in, char* plaintext_out)
+{
+	int n;
+
+	for (n = 0; n + 32 <= length_in; n += 32)
+	{
+		const __m256i in = _mm256_loadu_si256((const __m256i*)(code_in + n));
+		const __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), in));
+		const __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), in));
+		const __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(in, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), in));
+		const __m256i plus = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('+'));
+		const __m256i slash = _mm256_cmpeq_epi8(in, _mm256_set1_epi8('/'));
+		__m256i shift, packed;
+		char* out = plaintext_out + n / 4 * 3;
+
+		if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(upper, lower), _mm256_or_si256(_mm256_or_si256(digit, plus), slash))) != -1)
+			break;
+		shift = _mm256_or_si256(_mm256_and_si256(upper, _mm256_set1_epi8(-'A')), _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a')));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')));
+		shift = _mm256_or_si256(shift, _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')));
+
+		packed = _mm256_maddubs_epi16(_mm256_add_epi8(in, shift), _mm256_set1_epi32(0x01400140));
+		packed = _mm256_madd_epi16(packed, _mm256_set1_epi32(0x00011000));
+		packed = _mm256_shuffle_epi8(packed, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+
+		/* 12 bytes from each 128-bit lane */
+		base64_store12(_mm256_castsi256_si128(packed), out);
+		base64_store12(_mm256_extracti128_si256(packed, 1), out + 12);
+	}
+
+	/* Finish with a 16 character step if possible */
+	return n + base64_decode_ssse3(code_in + n, length_in - n, plaintext_out + n / 4 * 3);
+}
+#endif
+
+/* Run a vector kernel over as much of the input as it will take, and the state
+   machine over the rest */
+static int base64_decode_block_with(int (*kernel)(const char*, int, char*), const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in)
+{
+	const char* codechar = code_in;
+	const char* const codeend = code_in + length_in;
+	char* plainchar = plaintext_out;
+	int n;
+
+	while (codechar < codeend)
+	{
+		if (state_in->step == step_a)
+		{
+			n = kernel(codechar, codeend - codechar, plainchar);
+			codechar += n;
+			plainchar += n / 4 * 3;
+			if (codechar == codeend) break;
+		}
+
+		/* Step over the chunk that stopped the kernel, then to the end of the
+		   current group of four so that the kernel can take over again */
+		n = codeend - codechar < 16 ? codeend - codechar : 16;
+		plainchar += base64_decode_block_scalar(codechar, n, plainchar, state_in);
+		codechar += n;
+		while (state_in->step != step_a && codechar < codeend)
+			plainchar += base64_decode_block_scalar(codechar++, 1, plainchar, state_in);
+	}
+	return plainchar - plaintext_out;
+}
+
+#ifdef HAVE_X86_SIMD
+int base64_decode_block_ssse3(const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in)
+{
+	return base64_decode_block_with(base64_decode_ssse3, code_in, length_in, plaintext_out, state_in);
+}
+
+int base64_decode_block_avx2(const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in)
+{
+	return base64_decode_block_with(base64_decode_avx2, code_in, length_in, plaintext_out, state_in);
+}
+#endif
+
+/* Pick the best kernel for this CPU on first call */
+static int base64_decode_init(const char*, int, char*);
+static int (*base64_decode_kernel)(const char*, int, char*) = base64_decode_init;
+
+static int base64_decode_init(const char* code_in, int length_in, char* plaintext_out)
+{
+	int (*kernel)(const char*, int, char*) = base64_decode_none;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) kernel = base64_decode_avx2;
+	else if (__builtin_cpu_supports("ssse3")) kernel = base64_decode_ssse3;
+#endif
+	/* Threads racing here all pick the same kernel */
+	__atomic_store_n(&base64_decode_kernel, kernel, __ATOMIC_RELAXED);
+	return kernel(code_in, length_in, plaintext_out);
+}
+
+int base64_decode_block(const char* code_in, const int length_in, char* plaintext_out, base64_decodestate* state_in)
+{
+	return base64_decode_block_with(__atomic_load_n(&base64_decode_kernel, __ATOMIC_RELAXED), code_in, length_in, plaintext_out, state_in);
+}
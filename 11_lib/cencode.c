@@ -7,6 +7,11 @@ For details, see http://sourceforge.net/projects/libb64
 
 #include "b64/cencode.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
 /* const int CHARS_PER_LINE = 72; */
 
 void base64_init_encodestate(base64_encodestate* state_in)
@@ -23,7 +28,8 @@ char base64_encode_value(char value_in)
 	return encoding[(int)value_in];
 }
 
-int base64_encode_block(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in)
+/* Byte-at-a-time state machine, used for anything the vector kernels skip */
+int base64_encode_block_scalar(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in)
 {
 	const char* plainchar = plaintext_in;
 	const char* const plaintextend = plaintext_in + length_in;
@@ -86,6 +92,126 @@ int base64_encode_block(const char* plaintext_in, int length_in, char* code_out,
 	return codechar - code_out;
 }
 
+/* Vector kernels encode whole chunks of 3-byte groups, returning the number
+   of bytes consumed. They may read a few bytes past the last group they encode
+   but never past length_in. */
+
+static int base64_encode_none(const char* plaintext_in, int length_in, char* code_out)
+{
+	return 0;
+}
+
+#ifdef HAVE_X86_SIMD
+/* Spread each 3-byte group (in 4 bytes of a 32-bit lane, ordered by the
+   shuffle below) into four 6-bit indices, one per byte */
+#define BASE64_SPLIT_SHUFFLE 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10
+
+/* Map 6-bit indices to base64 characters */
+#define BASE64_SHIFT_LUT 'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+	'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0
+
+/* SSSE3 kernel, 12 bytes to 16 characters per step */
+__attribute__((target("ssse3")))
+static int base64_encode_ssse3(const char* plaintext_in, int length_in, char* code_out)
+{
+	int n;
+
+	for (n = 0; n + 16 <= length_in; n += 12)
+	{
+		__m128i in = _mm_loadu_si128((const __m128i*)(plaintext_in + n));
+		__m128i indices, offset;
+
+		in = _mm_shuffle_epi8(in, _mm_setr_epi8(BASE64_SPLIT_SHUFFLE));
+		indices = _mm_or_si128(
+			_mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040)),
+			_mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010)));
+
+		/* 0 for a-z, 1-12 for 0-9 + /, 13 for A-Z */
+		offset = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+		offset = _mm_or_si128(offset, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+		offset = _mm_shuffle_epi8(_mm_setr_epi8(BASE64_SHIFT_LUT), offset);
+		_mm_storeu_si128((__m128i*)(code_out + n / 3 * 4), _mm_add_epi8(indices, offset));
+	}
+	return n;
+}
+
+/* AVX2 kernel, 24 bytes to 32 characters per step */
+__attribute__((target("avx2")))
+static int base64_encode_avx2(const char* plaintext_in, int length_in, char* code_out)
+{
+	int n;
+
+	for (n = 0; n + 28 <= length_in; n += 24)
+	{
+		__m256i in = _mm256_inserti128_si256(
+			_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(plaintext_in + n))),
+			_mm_loadu_si128((const __m128i*)(plaintext_in + n + 12)), 1);
+		__m256i indices, offset;
+
+		in = _mm256_shuffle_epi8(in, _mm256_setr_epi8(BASE64_SPLIT_SHUFFLE, BASE64_SPLIT_SHUFFLE));
+		indices = _mm256_or_si256(
+			_mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)), _mm256_set1_epi32(0x04000040)),
+			_mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)), _mm256_set1_epi32(0x01000010)));
+
+		offset = _mm256_subs_epu8(indices, _mm256_set1_epi8(51));
+		offset = _mm256_or_si256(offset, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices), _mm256_set1_epi8(13)));
+		offset = _mm256_shuffle_epi8(_mm256_setr_epi8(BASE64_SHIFT_LUT, BASE64_SHIFT_LUT), offset);
+		_mm256_storeu_si256((__m256i*)(code_out + n / 3 * 4), _mm256_add_epi8(indices, offset));
+	}
+
+	/* Finish with 12 byte steps */
+	return n + base64_encode_ssse3(plaintext_in + n, length_in - n, code_out + n / 3 * 4);
+}
+#endif
+
+/* Run a vector kernel over whole groups when starting on a group boundary,
+   and the state machine over the rest */
+static int base64_encode_block_with(int (*kernel)(const char*, int, char*), const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in)
+{
+	int n = 0;
+
+	if (state_in->step == step_A)
+	{
+		n = kernel(plaintext_in, length_in, code_out);
+		state_in->stepcount += n / 3;
+	}
+	return n / 3 * 4 + base64_encode_block_scalar(plaintext_in + n, length_in - n, code_out + n / 3 * 4, state_in);
+}
+
+#ifdef HAVE_X86_SIMD
+int base64_encode_block_ssse3(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in)
+{
+	return base64_encode_block_with(base64_encode_ssse3, plaintext_in, length_in, code_out, state_in);
+}
+
+int base64_encode_block_avx2(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in)
+{
+	return base64_encode_block_with(base64_encode_avx2, plaintext_in, length_in, code_out, state_in);
+}
+#endif
+
+/* Pick the best kernel for this CPU on first call */
+static int base64_encode_init(const char*, int, char*);
+static int (*base64_encode_kernel)(const char*, int, char*) = base64_encode_init;
+
+static int base64_encode_init(const char* plaintext_in, int length_in, char* code_out)
+{
+	int (*kernel)(const char*, int, char*) = base64_encode_none;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) kernel = base64_encode_avx2;
+	else if (__builtin_cpu_supports("ssse3")) kernel = base64_encode_ssse3;
+#endif
+	/* Threads racing here all pick the same kernel */
+	__atomic_store_n(&base64_encode_kernel, kernel, __ATOMIC_RELAXED);
+	return kernel(plaintext_in, length_in, code_out);
+}
+
+int base64_encode_block(const char* plaintext_in, int length_in, char* code_out, base64_encodestate* state_in)
+{
+	return base64_encode_block_with(__atomic_load_n(&base64_encode_kernel, __ATOMIC_RELAXED), plaintext_in, length_in, code_out, state_in);
+}
+
 int base64_encode_blockend(char* code_out, base64_encodestate* state_in)
 {
 	char* codechar = code_out;
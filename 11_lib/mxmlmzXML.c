@@ -6,6 +6,7 @@
 
 #define B64ENCODEMAXDESTLENGTH(n) ((n)*2)
 #define B64DECODEMAXDESTLENGTH(n) ((n)*3/4+1)
+#define DECODE_CHUNK 4096 // base64 characters decoded before swapping them
 
 #ifdef __APPLE__
 #include <libkern/OSByteOrder.h>
@@ -18,11 +19,12 @@
 #endif
 
 #include <stdint.h>
-#include <assert.h>
 #include "mxmlmzXML.h"
 #include "b64/cdecode.h"
 #include "b64/cencode.h"
 #include "easyzlib.h"
+#include "tofcodec.h"
+#include "sha1.h"
 
 // Custom mzXML data loading callback function
 mxml_type_t mzXML_load_cb(mxml_node_t *node) {
@@ -32,83 +34,302 @@ mxml_type_t mzXML_load_cb(mxml_node_t *node) {
 	else return (MXML_OPAQUE);
 }
 
-// Custom mzXML peak data load function
-int mzXML_load_custom(mxml_node_t *node, const char *data) {
-	mxml_node_t *parent;
+// Worker pool for decoding peak lists, with no threads unless started
+static pool decode_pool;
+
+// Start n worker threads for decoding peak lists, or stop them if n is 0
+int mzXML_set_threads(int n) {
+	pool_destroy(&decode_pool);
+	return pool_init(&decode_pool, n);
+}
+
+// Function run on each peak list once decoded, on the decode pool
+static void (*decode_hook)(mzXML_peaks *) = NULL;
+
+// Set a function to transform every peak list as it is decoded, or NULL
+// It runs on a pool worker like the decode, so must not touch mxml nodes
+void mzXML_set_decode_hook(void (*hook)(mzXML_peaks *)) {
+	decode_hook = hook;
+}
+
+// Scratch space of each thread for base64 decoded peak lists that are still
+// to be inflated or TOF decoded, kept from one peak list to the next
+typedef struct {
+	char *data;
+	long size;
+} scratch;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_free(void *arg) {
+	free(((scratch *)arg)->data);
+	free(arg);
+}
+
+static void scratch_init(void) {
+	pthread_key_create(&scratch_key, scratch_free);
+}
+
+// Get at least size bytes of this thread's scratch space
+static char *scratch_get(long size) {
+	scratch *s;
+
+	pthread_once(&scratch_once, scratch_init);
+	if (!(s = pthread_getspecific(scratch_key))) {
+		s = calloc(1, sizeof(scratch));
+		pthread_setspecific(scratch_key, s);
+	}
+	if (size > s->size) {
+		free(s->data);
+		s->data = malloc(size);
+		s->size = size;
+	}
+	return s->data;
+}
+
+// Convert the words of data between byte offsets from and to from network
+// (big-endian) to host byteorder, in place
+static void swap_peaks(char *data, long from, long to, int precision) {
+	if (32 == precision) {
+		uint32_t *u32 = (uint32_t *)data;
+		for (long i = from/4; i < to/4; ++i) u32[i] = be32toh(u32[i]);
+	} else {
+		uint64_t *u64 = (uint64_t *)data;
+		for (long i = from/8; i < to/8; ++i) u64[i] = be64toh(u64[i]);
+	}
+}
+
+// compressionType of a peaks element as PEAKS_NONE, PEAKS_ZLIB or PEAKS_TOF
+int mzXML_compression(const char *type) {
+	if (type && !strcmp(type,"zlib")) return PEAKS_ZLIB;
+	if (type && !strcmp(type,"tof")) return PEAKS_TOF;
+	return PEAKS_NONE;
+}
+
+// Decode a base64 peak list, inflate it and convert it to host byteorder
+// Each peak list gets one allocation, sized from the base64 length or
+// zlib_len (compressedLen). Uncompressed lists are decoded straight into it
+// a chunk at a time, swapping each chunk while it is in cache. Compressed
+// and TOF coded lists are decoded into the thread's scratch space first.
+// Returns the peak pairs, which the caller frees, and their length in bytes,
+// or NULL if the list is corrupt. Safe to run on any thread.
+void *mzXML_decode(const char *coded, long coded_len, int compression, long zlib_len, int precision, long *length) {
+	int word = precision/8;
 	char *decoded;
-	long length;
 	base64_decodestate state;
 
-	parent = mxmlGetParent(node);
-	decoded = malloc(B64DECODEMAXDESTLENGTH(strlen(data)));
+	*length = 0;
 	base64_init_decodestate(&state);
-	length = base64_decode_block(data, strlen(data), (char *)decoded, &state);
-	decoded = realloc(decoded, length);
-
-	// Decompress zlib compressed peak lists
-	if (!strcmp(mxmlElementGetAttr(parent,"compressionType"),"zlib")) {
-		unsigned char *decomped;
-		long pnDestLen;
-
-		pnDestLen = atoi(mxmlElementGetAttr(parent,"compressedLen"));
-		decomped = malloc(pnDestLen);
-		if(ezuncompress(decomped, &pnDestLen, (unsigned char *)decoded, length) < 0) {
-			fprintf(stderr,"zlib decompression failed.\n");
-			return (-1);
+	if (compression == PEAKS_NONE) {
+		decoded = malloc(B64DECODEMAXDESTLENGTH(coded_len));
+		for (long done = 0, swapped = 0; done < coded_len; done += DECODE_CHUNK) {
+			long chunk = coded_len - done < DECODE_CHUNK ? coded_len - done : DECODE_CHUNK;
+			*length += base64_decode_block(coded + done, chunk, decoded + *length, &state);
+			swap_peaks(decoded, swapped, *length - *length % word, precision);
+			swapped = *length - *length % word;
 		}
-		length = pnDestLen;
+		if (*length % (2*word)) { // Not a whole number of pairs
+			free(decoded);
+			return NULL;
+		}
+		return decoded;
+	}
+
+	char *code = scratch_get(B64DECODEMAXDESTLENGTH(coded_len));
+	long code_len = base64_decode_block(coded, coded_len, code, &state);
+
+	if (compression == PEAKS_TOF) {
+		void *pairs;
+		if ((*length = tof_decode((unsigned char *)code, code_len, precision, &pairs)) < 0) return NULL;
+		return pairs;
+	}
+
+	// Inflate zlib compressed peak lists to the length given by compressedLen
+	*length = zlib_len;
+	decoded = malloc(zlib_len > 0 ? zlib_len : 1);
+	if (ezuncompress((unsigned char *)decoded, length, (unsigned char *)code, code_len) < 0 ||
+		*length % (2*word)) {
 		free(decoded);
-		decoded = (char *)decomped;
+		return NULL;
 	}
+	swap_peaks(decoded, 0, *length, precision);
+	return decoded;
+}
 
-	// Convert to host byteorder and sort by m/z
-	if (!strcmp(mxmlElementGetAttr(parent,"precision"),"32")) {
-		uint32_t *u32 = (uint32_t *)decoded;
-		assert(0 == length % 8); // Whole number of pairs?
-		for(int i = 0; i < length/4; ++i) u32[i] = be32toh(u32[i]);
-	} else {
-		uint64_t *u64 = (uint64_t *)decoded;
-		assert(0 == length % 16); // Whole number of pairs?
-		for(int i = 0; i < length/8; ++i) u64[i] = be64toh(u64[i]);
+// Decode the base64 text of a peak list, then free it
+// Runs on a pool worker, so must not touch any mxml nodes
+static void mzXML_decode_peaks(void *arg) {
+	mzXML_peaks *peaks = (mzXML_peaks *)arg;
+	int compression = peaks->tof ? PEAKS_TOF : peaks->zlib_len >= 0 ? PEAKS_ZLIB : PEAKS_NONE;
+
+	peaks->data = mzXML_decode(peaks->coded, peaks->coded_len, compression, peaks->zlib_len,
+		peaks->precision, &peaks->length);
+	free(peaks->coded);
+	peaks->coded = NULL;
+	if (!peaks->data) {
+		peaks->error = 1;
+		return;
 	}
+	if (decode_hook) decode_hook(peaks);
+}
 
-	mxmlSetCustom(node,decoded,mzXML_destroy_custom);
-	mxmlElementSetAttrf(parent,"compressedLen","%lu",length);
-	
+// Custom mzXML peak data load function
+// Only the base64 text is kept, so scans the caller drops are never decoded.
+// Use mzXML_decode_ahead to start decoding it and mzXML_get_peaks to get it.
+int mzXML_load_custom(mxml_node_t *node, const char *data) {
+	mxml_node_t *parent;
+	mzXML_peaks *peaks;
+
+	parent = mxmlGetParent(node);
+	peaks = calloc(1, sizeof(mzXML_peaks));
+	peaks->coded_len = strlen(data);
+	peaks->coded = malloc(peaks->coded_len + 1);
+	memcpy(peaks->coded, data, peaks->coded_len + 1);
+	if (!strcmp(mxmlElementGetAttr(parent,"compressionType"),"zlib"))
+		peaks->zlib_len = atoi(mxmlElementGetAttr(parent,"compressedLen"));
+	else peaks->zlib_len = -1;
+	peaks->tof = !strcmp(mxmlElementGetAttr(parent,"compressionType"),"tof");
+	if (!strcmp(mxmlElementGetAttr(parent,"precision"),"32")) peaks->precision = 32;
+	else peaks->precision = 64;
+
+	mxmlSetCustom(node,peaks,mzXML_destroy_custom);
 	return (0);
 }
 
+// Queue the peak list of a peaks node for decoding on the pool, so that it is
+// ready by the time mzXML_get_peaks asks for it
+// Without worker threads it is left to decode on first use.
+void mzXML_decode_ahead(mxml_node_t *node) {
+	mzXML_peaks *peaks = node ? (mzXML_peaks *)mxmlGetCustom(node) : NULL;
+
+	if (!peaks || peaks->ready || peaks->queued || decode_pool.n_threads == 0) return;
+	peaks->queued = 1;
+	pool_submit(&decode_pool, &peaks->task, mzXML_decode_peaks, peaks);
+}
+
+// Get the decoded peak list of a peaks node, decoding it on first use or
+// waiting for the decode queued by mzXML_decode_ahead
+// Returns the peak pairs in host byteorder and their length in bytes
+void *mzXML_get_peaks(mxml_node_t *node, long *length) {
+	mzXML_peaks *peaks = (mzXML_peaks *)mxmlGetCustom(node);
+
+	if (!peaks) return NULL;
+	if (!peaks->ready) {
+		if (peaks->queued) pool_wait(&decode_pool, &peaks->task);
+		else mzXML_decode_peaks(peaks);
+		if (peaks->error) {
+			fprintf(stderr,"Peak list decompression failed.\n");
+			exit( 131 );
+		}
+		peaks->ready = 1;
+	}
+	if (length) *length = peaks->length;
+	return peaks->data;
+}
+
+// Replace the peak list of a peaks node with data of length bytes
+// The node takes ownership of data
+void mzXML_set_peaks(mxml_node_t *node, void *data, long length) {
+	mzXML_peaks *peaks = (mzXML_peaks *)mxmlGetCustom(node);
+
+	mzXML_get_peaks(node, NULL); // Make sure no decode is still writing
+	free(peaks->data);
+	peaks->data = data;
+	peaks->length = length;
+}
+
+// Copy a node, and its subtree if deep, as a new tree with no parent
+// Peak lists are decoded first and copied, so the copy is ready to use
+mxml_node_t *mzXML_clone(mxml_node_t *node, int deep) {
+	mxml_node_t *copy = NULL;
+	mzXML_peaks *peaks;
+	void *data;
+	long length;
+
+	switch (mxmlGetType(node)) {
+		case MXML_ELEMENT:
+			copy = mxmlNewElement(MXML_NO_PARENT, mxmlGetElement(node));
+			for (int i = 0; i < node->value.element.num_attrs; ++i) {
+				mxml_attr_t *attr = &node->value.element.attrs[i];
+				mxmlElementSetAttr(copy, attr->name, attr->value);
+			}
+			if (deep) {
+				for (mxml_node_t *child = mxmlGetFirstChild(node); child; child = mxmlGetNextSibling(child)) {
+					mxml_node_t *child_copy = mzXML_clone(child, 1);
+					if (child_copy) mxmlAdd(copy, MXML_ADD_AFTER, MXML_ADD_TO_PARENT, child_copy);
+				}
+			}
+			break;
+		case MXML_OPAQUE:
+			copy = mxmlNewOpaque(MXML_NO_PARENT, mxmlGetOpaque(node));
+			break;
+		case MXML_CUSTOM:
+			data = mzXML_get_peaks(node, &length);
+			peaks = calloc(1, sizeof(mzXML_peaks));
+			peaks->task.state = TASK_DONE;
+			peaks->zlib_len = ((mzXML_peaks *)mxmlGetCustom(node))->zlib_len;
+			peaks->tof = ((mzXML_peaks *)mxmlGetCustom(node))->tof;
+			peaks->precision = ((mzXML_peaks *)mxmlGetCustom(node))->precision;
+			peaks->data = malloc(length);
+			memcpy(peaks->data, data, length);
+			peaks->length = length;
+			peaks->ready = 1;
+			copy = mxmlNewCustom(MXML_NO_PARENT, peaks, mzXML_destroy_custom);
+			break;
+		default:
+			break;
+	}
+	return copy;
+}
+
 // Custom mzXML peak data destructor function
 void mzXML_destroy_custom(void *data) {
-	free(data);
+	mzXML_peaks *peaks = (mzXML_peaks *)data;
+
+	// A queued decode is dropped, a running one is waited for
+	if (peaks->queued) pool_cancel(&decode_pool, &peaks->task);
+	free(peaks->coded);
+	free(peaks->data);
+	free(peaks);
 }
 
 // Custom mzXML peak data save function
 char *mzXML_save_custom(mxml_node_t *node) {
-	mxml_node_t *parent;
-	char *coded, *decoded;
+	mxml_node_t *parent = mxmlGetParent(node);
 	long length;
-	base64_encodestate state;
+	void *data = mzXML_get_peaks(node, &length);
+	int precision = strcmp(mxmlElementGetAttr(parent,"precision"),"32") ? 64 : 32;
 
-	parent = mxmlGetParent(node);
-	length = atoi(mxmlElementGetAttr(parent,"compressedLen"));
-	decoded = (char *)mxmlGetCustom(node);
-	
-	int compress_peaks = 0;
-	if (!strcmp(mxmlElementGetAttr(parent,"compressionType"),"zlib"))
-		compress_peaks = 1;
+	return mzXML_encode(data, length, mzXML_compression(mxmlElementGetAttr(parent,"compressionType")), precision);
+}
 
-	// Convert to network (big-endian) byteorder
-	if (!strcmp(mxmlElementGetAttr(parent,"precision"),"32")) {
-		uint32_t *u32 = (uint32_t *)decoded;
-		for(int i = 0; i < length/4; ++i) u32[i] = htobe32(u32[i]);
-	} else {
-		uint64_t *u64 = (uint64_t *)decoded;
-		for(int i = 0; i < length/8; ++i) u64[i] = htobe64(u64[i]);
+// Code a peak list of length bytes in host byteorder as base64 text of the
+// given compressionType, which the caller frees
+char *mzXML_encode(const void *data, long length, int compression, int precision) {
+	char *coded, *decoded;
+	base64_encodestate state;
+
+	// TOF coding takes the host order peak list, and fixes its own byteorder
+	if (compression == PEAKS_TOF) {
+		unsigned char *tof_coded;
+		length = tof_encode(data, length, precision, &tof_coded);
+		decoded = (char *)tof_coded;
+	}
+	// Otherwise convert a copy to network (big-endian) byteorder
+	else {
+		decoded = memcpy(malloc(length > 0 ? length : 1), data, length);
+		if (32 == precision) {
+			uint32_t *u32 = (uint32_t *)decoded;
+			for(int i = 0; i < length/4; ++i) u32[i] = htobe32(u32[i]);
+		} else {
+			uint64_t *u64 = (uint64_t *)decoded;
+			for(int i = 0; i < length/8; ++i) u64[i] = htobe64(u64[i]);
+		}
 	}
 
 	// Compress peak list using zlib
-	if (compress_peaks) {
+	if (compression == PEAKS_ZLIB) {
 		long pnDestLen = EZ_COMPRESSMAXDESTLENGTH(length);
 		unsigned char *comped = malloc(pnDestLen);
 		if(ezcompress(comped,&pnDestLen,(unsigned char*)decoded,length) < 0) {
@@ -117,6 +338,7 @@ char *mzXML_save_custom(mxml_node_t *node) {
 		}
 		comped = realloc(comped,pnDestLen);
 		length = pnDestLen;
+		free(decoded);
 		decoded = (char *)comped;
 	}
 	
@@ -127,7 +349,7 @@ char *mzXML_save_custom(mxml_node_t *node) {
 	length += base64_encode_blockend(coded+length, &state);
 	coded = realloc(coded, length);
 
-	if (compress_peaks) free(decoded);
+	free(decoded);
 	return (coded);
 }
 
@@ -147,6 +369,184 @@ const char *mzXML_whitespace_cb(mxml_node_t *node, int where) {
 	}
 }
 
+// Write string to file, escaping XML entities as mxmlSaveFile does
+static int mzXML_write_string(const char *s, FILE *fp) {
+	for (; *s; ++s) {
+		switch (*s) {
+			case '&':
+				fputs("&amp;", fp);
+				break;
+			case '<':
+				fputs("&lt;", fp);
+				break;
+			case '>':
+				fputs("&gt;", fp);
+				break;
+			case '"':
+				fputs("&quot;", fp);
+				break;
+			default:
+				putc(*s, fp);
+				break;
+		}
+	}
+	return ferror(fp) ? -1 : 0;
+}
+
+// Write the attributes of an element node as ' name="value"' pairs
+int mzXML_write_attrs(mxml_node_t *node, FILE *fp) {
+	if (mxmlGetType(node) != MXML_ELEMENT) return (-1);
+
+	for (int i = 0; i < node->value.element.num_attrs; ++i) {
+		mxml_attr_t *attr = &node->value.element.attrs[i];
+		fprintf(fp, " %s", attr->name);
+		if (attr->value) {
+			fputs("=\"", fp);
+			mzXML_write_string(attr->value, fp);
+			putc('"', fp);
+		}
+	}
+	return ferror(fp) ? -1 : 0;
+}
+
+// Write a node and its subtree exactly as mxmlSaveFile would with
+// mzXML_whitespace_cb and no wrap margin, so that scans can be written out
+// one at a time without holding the whole document
+int mzXML_write_node(mxml_node_t *node, FILE *fp) {
+	return mzXML_write_node_indexed(node, fp, NULL);
+}
+
+// Write a node as mzXML_write_node does, adding the offset of each scan
+// written to index if it is not NULL
+int mzXML_write_node_indexed(mxml_node_t *node, FILE *fp, mzXML_index *index) {
+	const char *name;
+	char *data;
+
+	switch (mxmlGetType(node)) {
+		case MXML_ELEMENT:
+			name = mxmlGetElement(node);
+			if (index && !strcmp(name, "scan")) {
+				const char *num = mxmlElementGetAttr(node, "num");
+				mzXML_index_add(index, num ? atoi(num) : 0, ftell(fp));
+			}
+			// compressedLen of a peak list is its decoded length
+			if (!strcmp(name, "peaks") && mxmlGetCustom(node)) {
+				long length;
+				mzXML_get_peaks(node, &length);
+				mxmlElementSetAttrf(node, "compressedLen", "%ld", length);
+			}
+			fprintf(fp, "<%s", name);
+			mzXML_write_attrs(node, fp);
+			if (mxmlGetFirstChild(node)) {
+				fputs(">\n", fp);
+				for (mxml_node_t *child = mxmlGetFirstChild(node); child; child = mxmlGetNextSibling(child))
+					if (mzXML_write_node_indexed(child, fp, index) < 0) return (-1);
+				// Directives and comments have no end tags
+				if (name[0] != '?' && name[0] != '!') fprintf(fp, "</%s>\n", name);
+			} else if (name[0] == '?' || name[0] == '!') {
+				fputs(">\n", fp);
+			} else fputs(" />\n", fp);
+			break;
+		case MXML_OPAQUE:
+			mzXML_write_string(mxmlGetOpaque(node), fp);
+			break;
+		case MXML_CUSTOM:
+			data = mzXML_save_custom(node);
+			fputs(data, fp);
+			free(data);
+			break;
+		default:
+			break;
+	}
+	return ferror(fp) ? -1 : 0;
+}
+
+// Note the output offset of a scan for the index
+void mzXML_index_add(mzXML_index *index, unsigned int num, long offset) {
+	if (index->n == index->size) {
+		index->size = index->size ? 2 * index->size : 1024;
+		index->nums = realloc(index->nums, index->size * sizeof(unsigned int));
+		index->offsets = realloc(index->offsets, index->size * sizeof(long));
+	}
+	index->nums[index->n] = num;
+	index->offsets[index->n++] = offset;
+}
+
+// Write the scan index and indexOffset, and open the sha1 element to be
+// finished by mzXML_write_sha1 once the file is complete up to that point
+// The index is emptied.
+int mzXML_write_index(mzXML_index *index, FILE *fp) {
+	long index_offset = ftell(fp);
+
+	fputs("<index name=\"scan\">\n", fp);
+	for (int i = 0; i < index->n; ++i)
+		fprintf(fp, "<offset id=\"%u\">%ld</offset>\n", index->nums[i], index->offsets[i]);
+	fprintf(fp, "</index>\n<indexOffset>%ld</indexOffset>\n<sha1>", index_offset);
+
+	free(index->nums);
+	free(index->offsets);
+	index->nums = NULL;
+	index->offsets = NULL;
+	index->n = index->size = 0;
+	return ferror(fp) ? -1 : 0;
+}
+
+// Hash the file from its start to the open sha1 element and write the
+// digest and sha1 end tag, as the mzXML schema specifies
+// The file is read back, so it must be opened for update ("w+").
+int mzXML_write_sha1(FILE *fp) {
+	char buffer[1 << 16];
+	unsigned char digest[SHA1_DIGEST_LENGTH];
+	sha1_ctx ctx;
+	long end, left;
+
+	if (fflush(fp) || (end = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET)) return (-1);
+	sha1_init(&ctx);
+	for (left = end; left > 0; ) {
+		size_t n = fread(buffer, 1, left < sizeof(buffer) ? left : sizeof(buffer), fp);
+		if (n == 0) return (-1);
+		sha1_update(&ctx, buffer, n);
+		left -= n;
+	}
+	sha1_final(&ctx, digest);
+
+	if (fseek(fp, end, SEEK_SET)) return (-1);
+	for (int i = 0; i < SHA1_DIGEST_LENGTH; ++i) fprintf(fp, "%02x", digest[i]);
+	fputs("</sha1>\n", fp);
+	return ferror(fp) ? -1 : 0;
+}
+
+// Write a node for mzXML_save_file, finishing the index at the mzXML end tag
+static int mzXML_save_node(mxml_node_t *node, FILE *fp, mzXML_index *index) {
+	const char *name = mxmlGetElement(node);
+
+	if (!name || !mxmlGetFirstChild(node) || (name[0] != '?' && strcmp(name, "mzXML")))
+		return mzXML_write_node_indexed(node, fp, index);
+
+	fprintf(fp, "<%s", name);
+	mzXML_write_attrs(node, fp);
+	fputs(">\n", fp);
+	for (mxml_node_t *child = mxmlGetFirstChild(node); child; child = mxmlGetNextSibling(child)) {
+		const char *child_name = mxmlGetElement(child);
+		if (child_name && (!strcmp(child_name, "index") || !strcmp(child_name, "indexOffset") ||
+			!strcmp(child_name, "sha1"))) continue;
+		if (mzXML_save_node(child, fp, index) < 0) return (-1);
+	}
+	if (name[0] == '?') return ferror(fp) ? -1 : 0;
+
+	if (mzXML_write_index(index, fp) < 0 || mzXML_write_sha1(fp) < 0) return (-1);
+	fprintf(fp, "</%s>\n", name);
+	return ferror(fp) ? -1 : 0;
+}
+
+// Write a whole mzXML tree as mxmlSaveFile would, but with a fresh scan
+// index, indexOffset and sha1 in place of any loaded with it
+// The file must be opened for update, as for mzXML_write_sha1.
+int mzXML_save_file(mxml_node_t *node, FILE *fp) {
+	mzXML_index index = {0};
+	return mzXML_save_node(node, fp, &index);
+}
+
 // Converts XML xs:duration strings to seconds (without validation)
 double xsduration_to_s(const char *str) {
 #define MINUTE_S 60
@@ -159,7 +559,7 @@ double xsduration_to_s(const char *str) {
 	int n = 0; // start of number substring
 	int t = 0; // passed T in string?
 
-	for (int i = 1; i < strlen(str); ++i) { // skip first P character
+	for (int i = 1, length = strlen(str); i < length; ++i) { // skip first P character
 		switch (str[i]) {
 			case 'T':
 				t = 1; // Passed T
@@ -8,12 +8,57 @@
 #define _MXMLMZXML_H
 
 #include "mxml.h"
+#include "pool.h"
+
+// Peak list held as the custom data of a peaks node
+// It is held as base64 text until first use, and may still be decoding on
+// the pool once queued until mzXML_get_peaks is called
+typedef struct {
+	pool_task task;
+	int queued;     // Decode handed to the pool by mzXML_decode_ahead
+	char *coded;    // base64 text, freed once decoded
+	long coded_len;
+	long zlib_len;  // Inflated length from compressedLen, or -1 if not zlib
+	int tof;        // Coded as TOF grid indices (compressionType "tof")
+	int precision;  // 32 or 64
+	void *data;     // Peak pairs in host byteorder
+	long length;    // Length of data in bytes
+	int ready, error;
+} mzXML_peaks;
+
+// compressionType of a peak list
+enum {
+	PEAKS_NONE, PEAKS_ZLIB, PEAKS_TOF
+};
+
+// Output offsets of scans, collected while writing for the scan index
+typedef struct {
+	unsigned int *nums;
+	long *offsets;
+	int n, size;
+} mzXML_index;
 
 mxml_type_t mzXML_load_cb(mxml_node_t *);
+int mzXML_set_threads(int);
+void mzXML_set_decode_hook(void (*)(mzXML_peaks *));
+int mzXML_compression(const char *);
+void *mzXML_decode(const char *, long, int, long, int, long *);
+char *mzXML_encode(const void *, long, int, int);
 int mzXML_load_custom(mxml_node_t *, const char *);
+void mzXML_decode_ahead(mxml_node_t *);
+void *mzXML_get_peaks(mxml_node_t *, long *);
+void mzXML_set_peaks(mxml_node_t *, void *, long);
+mxml_node_t *mzXML_clone(mxml_node_t *, int);
 void mzXML_destroy_custom(void *);
 char *mzXML_save_custom(mxml_node_t *);
 const char *mzXML_whitespace_cb(mxml_node_t *, int);
+int mzXML_write_attrs(mxml_node_t *, FILE *);
+int mzXML_write_node(mxml_node_t *, FILE *);
+int mzXML_write_node_indexed(mxml_node_t *, FILE *, mzXML_index *);
+void mzXML_index_add(mzXML_index *, unsigned int, long);
+int mzXML_write_index(mzXML_index *, FILE *);
+int mzXML_write_sha1(FILE *);
+int mzXML_save_file(mxml_node_t *, FILE *);
 double xsduration_to_s(const char *);
 
 FILE *openfile(const char *,const char *);
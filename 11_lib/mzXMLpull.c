@@ -0,0 +1,221 @@
+//  mzXMLpull.c
+//
+//  Copyright 2012 David Khoo <davidk@bii.a-star.edu.sg>
+//
+//  Pull parser for the scans of an mzXML file
+//
+//  The file is mapped into memory and searched for tags with memchr, so
+//  that only scan and peaks start tags are ever parsed. Peak lists are left
+//  as base64 text in the file for the caller to decode with mzXML_decode.
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mxmlmzXML.h"
+#include "mzXMLpull.h"
+
+// Whether c is XML whitespace
+static int space(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Whether p starts with s, without reading past end
+static int starts(const char *p, const char *end, const char *s) {
+	long n = strlen(s);
+	return end - p >= n && !memcmp(p, s, n);
+}
+
+// Whether p is the start tag of element name
+static int is_tag(const char *p, const char *end, const char *name) {
+	long n = strlen(name);
+	return end - p > n + 1 && p[0] == '<' && !memcmp(p + 1, name, n) &&
+		(space(p[n+1]) || p[n+1] == '>' || p[n+1] == '/');
+}
+
+// First s from p before end, or NULL
+static const char *find(const char *p, const char *end, const char *s) {
+	while ((p = memchr(p, s[0], end - p)) && !starts(p, end, s)) ++p;
+	return p;
+}
+
+// Last s before end, or NULL
+static const char *find_last(const char *data, const char *end, const char *s) {
+	for (const char *p = end - strlen(s); p >= data; --p)
+		if (*p == s[0] && starts(p, end, s)) return p;
+	return NULL;
+}
+
+// End of a comment, processing instruction or CDATA section at p, end if it
+// is cut short, or NULL if p is none of these
+static const char *skip_markup(const char *p, const char *end) {
+	static const char *marks[][2] = {{"<!--", "-->"}, {"<?", "?>"}, {"<![CDATA[", "]]>"}};
+
+	for (int i = 0; i < 3; ++i) {
+		if (!starts(p, end, marks[i][0])) continue;
+		p = find(p + strlen(marks[i][0]), end, marks[i][1]);
+		return p ? p + strlen(marks[i][1]) : end;
+	}
+	return NULL;
+}
+
+// The '>' closing the tag at p, skipping any in attribute values, or NULL
+static const char *tag_end(const char *p, const char *end) {
+	for (char quote = 0; p < end; ++p) {
+		if (quote) {
+			if (*p == quote) quote = 0;
+		} else if (*p == '"' || *p == '\'') quote = *p;
+		else if (*p == '>') return p;
+	}
+	return NULL;
+}
+
+// Store a scan or peaks attribute
+static void read_attr(mzXML_scan *s, const char *name, long name_len, const char *value, long value_len) {
+	char text[64];
+	long n = value_len < sizeof(text) - 1 ? value_len : sizeof(text) - 1;
+
+	memcpy(text, value, n);
+	text[n] = '\0';
+#define IS(attr) (name_len == sizeof(attr) - 1 && !memcmp(name, attr, name_len))
+	if (IS("num")) s->num = strtoul(text, NULL, 10);
+	else if (IS("scanType")) strcpy(s->scan_type, text);
+	else if (IS("msLevel")) s->ms_level = atoi(text);
+	else if (IS("polarity")) s->polarity = text[0];
+	else if (IS("retentionTime")) s->rt = xsduration_to_s(text);
+	else if (IS("lowMz")) s->low_mz = atof(text);
+	else if (IS("highMz")) s->high_mz = atof(text);
+	else if (IS("peaksCount")) s->peaks_count = atol(text);
+	else if (IS("precision")) s->precision = atoi(text);
+	else if (IS("compressionType")) s->compression = mzXML_compression(text);
+	else if (IS("compressedLen")) s->zlib_len = atol(text);
+#undef IS
+}
+
+// Store the attributes of the tag from p to its closing '>'
+static void read_attrs(mzXML_scan *s, const char *p, const char *close) {
+	while (p < close) {
+		while (p < close && space(*p)) ++p;
+		const char *name = p, *value;
+		while (p < close && *p != '=' && *p != '/' && !space(*p)) ++p;
+		long name_len = p - name;
+		while (p < close && space(*p)) ++p;
+		if (p < close && *p != '=') {
+			if (name_len == 0) ++p;
+			continue;
+		}
+		if (++p >= close) break;
+		while (p < close && space(*p)) ++p;
+		if (p >= close || (*p != '"' && *p != '\'')) break;
+		value = p + 1;
+		if (!(p = memchr(value, *p, close - value))) break;
+		read_attr(s, name, name_len, value, p - value);
+		++p;
+	}
+}
+
+// Read the scan whose start tag is at start, with its first peaks element
+// before any nested scan or the end of the scan
+static mzXML_scan *read_scan(mzXML_pull *p, const char *start) {
+	mzXML_scan *s = &p->scan;
+	const char *end = p->data + p->tail, *close = tag_end(start, end), *q, *skip;
+
+	if (!close) {
+		p->pos = p->tail;
+		return NULL;
+	}
+	memset(s, 0, sizeof(mzXML_scan));
+	s->offset = start - p->data;
+	s->precision = 32;
+	read_attrs(s, start + strlen("<scan"), close);
+	p->pos = close + 1 - p->data;
+
+	for (q = close + 1; (q = memchr(q, '<', end - q)); ) {
+		if ((skip = skip_markup(q, end))) {
+			q = skip;
+			continue;
+		}
+		if (is_tag(q, end, "scan") || starts(q, end, "</scan")) break;
+		if (!is_tag(q, end, "peaks")) {
+			++q;
+			continue;
+		}
+
+		// An empty peaks element has no payload to replace
+		if (!(close = tag_end(q, end))) break;
+		read_attrs(s, q + strlen("<peaks"), close);
+		if (close[-1] == '/') break;
+		s->payload = close + 1;
+		if (!(q = memchr(s->payload, '<', end - s->payload))) q = end;
+		s->payload_len = q - s->payload;
+		p->pos = q - p->data;
+		break;
+	}
+	return s;
+}
+
+// Start of the index, indexOffset, sha1 and </mzXML> at the end of the file,
+// with the indentation of their line, or size if the root is not mzXML
+static long find_tail(const char *data, long size) {
+	const char *root = find_last(data, data + size, "</mzXML"), *run, *p;
+
+	if (!root) return size;
+	run = find_last(data, root, "</msRun>");
+	p = run ? memchr(run + strlen("</msRun>"), '<', root + 1 - run - strlen("</msRun>")) : root;
+	while (p > data && (p[-1] == ' ' || p[-1] == '\t')) --p;
+	return p - data;
+}
+
+// Map an mzXML file into memory for pulling its scans, or return NULL
+mzXML_pull *mzXML_pull_open(const char *name) {
+	mzXML_pull *p = calloc(1, sizeof(mzXML_pull));
+	struct stat st;
+	void *data;
+
+	if ((p->fd = open(name, O_RDONLY)) < 0 || fstat(p->fd, &st) || st.st_size == 0 ||
+		(data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, p->fd, 0)) == MAP_FAILED) {
+		mzXML_pull_close(p);
+		return NULL;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	p->data = data;
+	p->size = st.st_size;
+	p->tail = find_tail(p->data, p->size);
+	return p;
+}
+
+void mzXML_pull_close(mzXML_pull *p) {
+	if (!p) return;
+	if (p->data) munmap((void *)p->data, p->size);
+	if (p->fd >= 0) close(p->fd);
+	free(p);
+}
+
+// Next scan in file order, nested scans included, or NULL after the last
+mzXML_scan *mzXML_pull_next(mzXML_pull *p) {
+	const char *end = p->data + p->tail, *q = p->data + p->pos, *skip;
+
+	while (q < end && (q = memchr(q, '<', end - q))) {
+		if ((skip = skip_markup(q, end))) q = skip;
+		else if (is_tag(q, end, "scan")) return read_scan(p, q);
+		else ++q;
+	}
+	p->pos = p->tail;
+	return NULL;
+}
+
+// Write the file verbatim from where the last copy or skip ended up to the
+// offset upto
+int mzXML_pull_copy(mzXML_pull *p, FILE *fp, long upto) {
+	if (upto <= p->copied) return (0);
+	if (fwrite(p->data + p->copied, 1, upto - p->copied, fp) != upto - p->copied) return (-1);
+	p->copied = upto;
+	return (0);
+}
+
+// Leave the file up to the offset upto out of the copy
+void mzXML_pull_skip(mzXML_pull *p, long upto) {
+	if (upto > p->copied) p->copied = upto;
+}
@@ -0,0 +1,52 @@
+//  mzXMLpull.h
+//
+//  Copyright 2012 David Khoo <davidk@bii.a-star.edu.sg>
+//
+//  Header file for mzXMLpull.c
+
+#ifndef _MZXMLPULL_H
+#define _MZXMLPULL_H
+
+#include <stdio.h>
+
+// A scan as read by mzXML_pull_next, valid until the next call
+// Attributes missing from the file are left 0, except precision 32. payload
+// points into the file at the base64 text of the first peaks element of the
+// scan, or is NULL if the scan has none or it is empty.
+typedef struct {
+	long offset;          // File offset of the scan start tag
+	unsigned int num;
+	char scan_type[64];
+	int ms_level;
+	char polarity;        // '+', '-' or 0
+	double rt;            // retentionTime in s
+	double low_mz, high_mz;
+	long peaks_count;
+	int precision;        // 32 or 64
+	int compression;      // PEAKS_NONE, PEAKS_ZLIB or PEAKS_TOF
+	long zlib_len;        // Inflated length from compressedLen
+	const char *payload;
+	long payload_len;
+} mzXML_scan;
+
+// Scans pulled from an mzXML file mapped into memory, in file order with
+// nested scans included
+// Everything else is left as it is in the file, and can be copied out
+// verbatim between scans with mzXML_pull_copy.
+typedef struct {
+	int fd;
+	const char *data;
+	long size;
+	long pos;    // Where the search for the next scan starts
+	long copied; // End of what mzXML_pull_copy has handled
+	long tail;   // Start of the index, sha1 and </mzXML>, or size if none
+	mzXML_scan scan;
+} mzXML_pull;
+
+mzXML_pull *mzXML_pull_open(const char *);
+void mzXML_pull_close(mzXML_pull *);
+mzXML_scan *mzXML_pull_next(mzXML_pull *);
+int mzXML_pull_copy(mzXML_pull *, FILE *, long);
+void mzXML_pull_skip(mzXML_pull *, long);
+
+#endif /* _MZXMLPULL_H */
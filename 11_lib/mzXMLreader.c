@@ -0,0 +1,311 @@
+//  mzXMLreader.c
+//
+//  Copyright 2012 David Khoo <davidk@bii.a-star.edu.sg>
+//
+//  Random access to mzXML scans through the scan index
+//
+//  The index is taken from the file's own <index> when it is valid. If not,
+//  scan start tags are found by a byte search, and the result is cached in
+//  a sidecar <file>.idx for next time.
+
+#define INDEX_TAIL 4096 // Bytes at the end of file searched for indexOffset
+#define TAG_MAX 4096 // Longest scan start tag expected
+#define READ_CHUNK (1 << 20)
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "mxmlmzXML.h"
+#include "mzXMLreader.h"
+
+// Whether c may follow an element name
+static int name_end(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '>' || c == '/';
+}
+
+// Whether a scan start tag is at offset
+static int scan_at(mzXML_reader *r, long offset) {
+	char buffer[6];
+
+	return pread(fileno(r->fp), buffer, 6, offset) == 6 &&
+		!strncmp(buffer, "<scan", 5) && name_end(buffer[5]);
+}
+
+// Add a scan to the index
+static void add_scan(mzXML_reader *r, long *size, unsigned int num, long offset) {
+	if (r->n == *size) {
+		*size = *size ? 2 * *size : 1024;
+		r->nums = realloc(r->nums, *size * sizeof(unsigned int));
+		r->offsets = realloc(r->offsets, *size * sizeof(long));
+	}
+	r->nums[r->n] = num;
+	r->offsets[r->n++] = offset;
+}
+
+// Forget a loaded index that turned out to be wrong
+static void clear_scans(mzXML_reader *r) {
+	free(r->nums);
+	free(r->offsets);
+	r->nums = NULL;
+	r->offsets = NULL;
+	r->n = 0;
+}
+
+// Check that every offset is a scan start tag, in increasing order
+static int check_scans(mzXML_reader *r) {
+	if (r->n == 0) return (-1);
+	for (long i = 0; i < r->n; ++i) {
+		if (i > 0 && r->offsets[i] <= r->offsets[i-1]) return (-1);
+		if (!scan_at(r, r->offsets[i])) return (-1);
+	}
+	return (0);
+}
+
+// Load the <index> of the file through its indexOffset
+static int load_index(mzXML_reader *r, long file_size) {
+	char tail[INDEX_TAIL + 1], *p, *text;
+	long tail_size = file_size < INDEX_TAIL ? file_size : INDEX_TAIL, index_offset, size = 0;
+
+	if (pread(fileno(r->fp), tail, tail_size, file_size - tail_size) != tail_size) return (-1);
+	tail[tail_size] = '\0';
+	if (!(p = strstr(tail, "<indexOffset>"))) return (-1);
+	index_offset = atol(p + strlen("<indexOffset>"));
+	if (index_offset <= 0 || index_offset >= file_size) return (-1);
+
+	text = malloc(file_size - index_offset + 1);
+	if (pread(fileno(r->fp), text, file_size - index_offset, index_offset) != file_size - index_offset) {
+		free(text);
+		return (-1);
+	}
+	text[file_size - index_offset] = '\0';
+	if (strncmp(text, "<index", 6)) {
+		free(text);
+		return (-1);
+	}
+
+	// Read <offset id="num">offset</offset> up to </index>
+	char *end = strstr(text, "</index>");
+	if (end) *end = '\0';
+	for (p = strstr(text, "<offset"); p; p = strstr(p, "<offset")) {
+		char *id = strstr(p, "id=\""), *value = strchr(p, '>');
+		if (!id || !value) break;
+		add_scan(r, &size, strtoul(id + 4, NULL, 10), atol(value + 1));
+		p = value;
+	}
+	free(text);
+
+	if (check_scans(r)) {
+		clear_scans(r);
+		return (-1);
+	}
+	return (0);
+}
+
+// Load a sidecar index written for this exact file size and time
+static int load_sidecar(mzXML_reader *r, const char *name, struct stat *st) {
+	FILE *fp = fopen(name, "r");
+	long file_size, mtime, n, size = 0;
+
+	if (!fp) return (-1);
+	if (fscanf(fp, "mzXMLidx %ld %ld %ld", &file_size, &mtime, &n) != 3 ||
+		file_size != st->st_size || mtime != st->st_mtime) {
+		fclose(fp);
+		return (-1);
+	}
+	for (long i = 0; i < n; ++i) {
+		unsigned int num;
+		long offset;
+		if (fscanf(fp, "%u %ld", &num, &offset) != 2) break;
+		add_scan(r, &size, num, offset);
+	}
+	fclose(fp);
+
+	if (r->n != n || check_scans(r)) {
+		clear_scans(r);
+		return (-1);
+	}
+	return (0);
+}
+
+// Write the index to a sidecar file, if possible
+static void save_sidecar(mzXML_reader *r, const char *name, struct stat *st) {
+	FILE *fp = fopen(name, "w");
+
+	if (!fp) return;
+	fprintf(fp, "mzXMLidx %ld %ld %ld\n", (long)st->st_size, (long)st->st_mtime, r->n);
+	for (long i = 0; i < r->n; ++i) fprintf(fp, "%u %ld\n", r->nums[i], r->offsets[i]);
+	if (fclose(fp)) remove(name);
+}
+
+// Build the index by searching the file for scan start tags
+static int build_index(mzXML_reader *r) {
+	char *buffer = malloc(READ_CHUNK + TAG_MAX + 1);
+	long base = 0, used = 0, size = 0, n;
+
+	// Each pass keeps the last TAG_MAX bytes, so that tags are never cut
+	while ((n = pread(fileno(r->fp), buffer + used, READ_CHUNK, base + used)) > 0 || used > 0) {
+		long length = used + (n > 0 ? n : 0), limit = n > 0 ? length - TAG_MAX : length;
+		char *p = buffer;
+
+		buffer[length] = '\0';
+		while ((p = memchr(p, '<', buffer + length - p)) && p - buffer < limit) {
+			if (!strncmp(p, "<scan", 5) && p + 5 < buffer + length && name_end(p[5])) {
+				char *tag_end = memchr(p, '>', buffer + length - p), *num;
+				unsigned int scan_num = 0;
+				if (tag_end) {
+					*tag_end = '\0';
+					if ((num = strstr(p, " num=\"")) || (num = strstr(p, "\tnum=\"")) || (num = strstr(p, "\nnum=\"")))
+						scan_num = strtoul(num + 6, NULL, 10);
+					*tag_end = '>';
+				}
+				add_scan(r, &size, scan_num, base + (p - buffer));
+			}
+			++p;
+		}
+		if (n <= 0) break;
+		if (limit < 0) limit = 0;
+		memmove(buffer, buffer + limit, length - limit);
+		base += limit;
+		used = length - limit;
+	}
+	free(buffer);
+	return r->n > 0 ? 0 : -1;
+}
+
+// Open an mzXML file for random access, or return NULL if it has no scans
+mzXML_reader *mzXML_open(const char *name) {
+	mzXML_reader *r = calloc(1, sizeof(mzXML_reader));
+	struct stat st;
+
+	if (!(r->fp = fopen(name, "r")) || fstat(fileno(r->fp), &st)) {
+		mzXML_close(r);
+		return NULL;
+	}
+	if (load_index(r, st.st_size) == 0) return r;
+
+	char *sidecar = malloc(strlen(name) + 5);
+	sprintf(sidecar, "%s.idx", name);
+	if (load_sidecar(r, sidecar, &st) && build_index(r) == 0) save_sidecar(r, sidecar, &st);
+	free(sidecar);
+
+	if (r->n == 0) {
+		mzXML_close(r);
+		return NULL;
+	}
+	return r;
+}
+
+void mzXML_close(mzXML_reader *r) {
+	if (r->fp) fclose(r->fp);
+	free(r->nums);
+	free(r->offsets);
+	free(r);
+}
+
+// Position of the first scan numbered num or higher
+// Scan numbers must increase through the file
+long mzXML_find_num(mzXML_reader *r, unsigned int num) {
+	long low = 0, high = r->n;
+
+	while (low < high) {
+		long mid = low + (high - low) / 2;
+		if (r->nums[mid] < num) low = mid + 1;
+		else high = mid;
+	}
+	return low;
+}
+
+// Position of the first scan with retentionTime t s or later
+// Retention times must increase through the file
+long mzXML_find_time(mzXML_reader *r, double t) {
+	long low = 0, high = r->n;
+
+	while (low < high) {
+		long mid = low + (high - low) / 2;
+		mxml_node_t *tag = mzXML_read_tag(r, mid);
+		const char *rt = tag ? mxmlElementGetAttr(tag, "retentionTime") : NULL;
+		if (rt && xsduration_to_s(rt) < t) low = mid + 1;
+		else high = mid;
+		mxmlDelete(tag);
+	}
+	return low;
+}
+
+// Read just the start tag of scan i as an element without children
+mxml_node_t *mzXML_read_tag(mzXML_reader *r, long i) {
+	char buffer[TAG_MAX + 2], *end;
+	ssize_t n = pread(fileno(r->fp), buffer, TAG_MAX, r->offsets[i]);
+
+	if (n <= 0) return NULL;
+	buffer[n] = '\0';
+	if (!(end = strchr(buffer, '>'))) return NULL;
+	if (end[-1] != '/') *end++ = '/';
+	strcpy(end, ">");
+	return mxmlLoadString(NULL, buffer, MXML_NO_CALLBACK);
+}
+
+// Read the text of scan i, nested scans included, returning its length
+// in length if that is not NULL
+char *mzXML_read_text(mzXML_reader *r, long i, long *length) {
+	long size = 1 << 16, used = 0, pos = 0;
+	char *text = malloc(size + 1);
+	int depth = 0;
+
+	while (1) {
+		ssize_t n = pread(fileno(r->fp), text + used, size - used, r->offsets[i] + used);
+		if (n <= 0) break;
+		used += n;
+		text[used] = '\0';
+
+		// Count scan start and end tags until the first start tag is closed
+		char *p;
+		while ((p = memchr(text + pos, '<', used - pos))) {
+			char *tag_end = memchr(p, '>', text + used - p);
+			if (!tag_end) break; // Read more
+			if (!strncmp(p, "<scan", 5) && name_end(p[5])) {
+				if (tag_end[-1] != '/') ++depth;
+				else if (depth == 0) depth = -1; // An empty scan
+			} else if (!strncmp(p, "</scan>", 7)) --depth;
+			pos = tag_end + 1 - text;
+			if (depth <= 0) {
+				text[pos] = '\0';
+				if (length) *length = pos;
+				return text;
+			}
+		}
+		if (used == size) {
+			size *= 2;
+			text = realloc(text, size + 1);
+		}
+	}
+	free(text);
+	return NULL;
+}
+
+// Read everything before the first scan, closed off as a whole document
+// Parsed on its own, this gives the header of the run without any scans
+char *mzXML_read_header(mzXML_reader *r) {
+	const char *close = "</msRun>\n</mzXML>\n";
+	char *text = malloc(r->offsets[0] + strlen(close) + 1);
+
+	if (pread(fileno(r->fp), text, r->offsets[0], 0) != r->offsets[0]) {
+		free(text);
+		return NULL;
+	}
+	strcpy(text + r->offsets[0], close);
+	return text;
+}
+
+// Load scan i as a tree of its own, loading peaks with the custom handlers
+// and queueing them to decode. The caller frees it with mxmlDelete.
+mxml_node_t *mzXML_read_scan(mzXML_reader *r, long i) {
+	char *text = mzXML_read_text(r, i, NULL);
+	mxml_node_t *scan;
+
+	if (!text) return NULL;
+	scan = mxmlLoadString(NULL, text, mzXML_load_cb);
+	free(text);
+	if (scan) mzXML_decode_ahead(mxmlFindElement(scan, scan, "peaks", NULL, NULL, MXML_DESCEND));
+	return scan;
+}
@@ -0,0 +1,31 @@
+//  mzXMLreader.h
+//
+//  Copyright 2012 David Khoo <davidk@bii.a-star.edu.sg>
+//
+//  Header file for mzXMLreader.c
+
+#ifndef _MZXMLREADER_H
+#define _MZXMLREADER_H
+
+#include <stdio.h>
+#include "mxml.h"
+
+// Random access to the scans of an mzXML file through its scan index
+// Scans are in file order, nested scans included
+typedef struct {
+	FILE *fp;
+	long n;
+	unsigned int *nums; // Scan numbers
+	long *offsets;      // File offsets of scan start tags
+} mzXML_reader;
+
+mzXML_reader *mzXML_open(const char *);
+void mzXML_close(mzXML_reader *);
+long mzXML_find_num(mzXML_reader *, unsigned int);
+long mzXML_find_time(mzXML_reader *, double);
+mxml_node_t *mzXML_read_tag(mzXML_reader *, long);
+char *mzXML_read_text(mzXML_reader *, long, long *);
+char *mzXML_read_header(mzXML_reader *);
+mxml_node_t *mzXML_read_scan(mzXML_reader *, long);
+
+#endif /* _MZXMLREADER_H */
@@ -0,0 +1,130 @@
+//  pool.c
+//
+//  Copyright 2012 David Khoo <davidk@bii.a-star.edu.sg>
+//
+//  Minimal pthread worker pool
+
+#include <stdlib.h>
+#include "pool.h"
+
+// Worker thread: run queued tasks in order until the pool is stopped
+static void *pool_worker(void *arg) {
+	pool *p = arg;
+	pool_task *task;
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		while (!p->head && !p->stop) pthread_cond_wait(&p->work, &p->lock);
+		if (!p->head) break;
+
+		// Take task from head of queue
+		task = p->head;
+		p->head = task->next;
+		if (p->head) p->head->prev = NULL;
+		else p->tail = NULL;
+		task->state = TASK_RUNNING;
+
+		pthread_mutex_unlock(&p->lock);
+		task->fn(task->arg);
+		pthread_mutex_lock(&p->lock);
+
+		task->state = TASK_DONE;
+		pthread_cond_broadcast(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+// Start a pool of n_threads workers, returning 0 on success
+int pool_init(pool *p, int n_threads) {
+	p->threads = NULL;
+	p->n_threads = 0;
+	p->head = p->tail = NULL;
+	p->stop = 0;
+	if (n_threads <= 0) return 0;
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+	p->threads = malloc(n_threads * sizeof(pthread_t));
+	if (!p->threads) return -1;
+	for (int i = 0; i < n_threads; ++i) {
+		if (pthread_create(&p->threads[i], NULL, pool_worker, p)) {
+			pool_destroy(p);
+			return -2;
+		}
+		++p->n_threads;
+	}
+	return 0;
+}
+
+// Queue fn(arg) to run on the pool, using task to track it
+void pool_submit(pool *p, pool_task *task, void (*fn)(void *), void *arg) {
+	task->fn = fn;
+	task->arg = arg;
+	task->next = NULL;
+
+	if (p->n_threads == 0) {
+		// No workers, so run it now
+		task->state = TASK_RUNNING;
+		fn(arg);
+		task->state = TASK_DONE;
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	task->state = TASK_QUEUED;
+	task->prev = p->tail;
+	if (p->tail) p->tail->next = task;
+	else p->head = task;
+	p->tail = task;
+	pthread_cond_signal(&p->work);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Block until task has finished running
+void pool_wait(pool *p, pool_task *task) {
+	if (p->n_threads == 0) return;
+
+	pthread_mutex_lock(&p->lock);
+	while (task->state != TASK_DONE) pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+// Remove task from the queue if it has not started, else wait for it
+// Returns 1 if the task was cancelled and 0 if it ran
+int pool_cancel(pool *p, pool_task *task) {
+	if (p->n_threads == 0) return 0;
+
+	pthread_mutex_lock(&p->lock);
+	if (task->state == TASK_QUEUED) {
+		if (task->prev) task->prev->next = task->next;
+		else p->head = task->next;
+		if (task->next) task->next->prev = task->prev;
+		else p->tail = task->prev;
+		task->state = TASK_DONE;
+		pthread_mutex_unlock(&p->lock);
+		return 1;
+	}
+	while (task->state != TASK_DONE) pthread_cond_wait(&p->done, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+// Finish all queued tasks and stop the workers
+void pool_destroy(pool *p) {
+	if (p->threads) {
+		pthread_mutex_lock(&p->lock);
+		p->stop = 1;
+		pthread_cond_broadcast(&p->work);
+		pthread_mutex_unlock(&p->lock);
+		for (int i = 0; i < p->n_threads; ++i) pthread_join(p->threads[i], NULL);
+
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->work);
+		pthread_cond_destroy(&p->done);
+		free(p->threads);
+	}
+	p->threads = NULL;
+	p->n_threads = 0;
+}
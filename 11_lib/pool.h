@@ -0,0 +1,41 @@
+//  pool.h
+//
+//  Copyright 2012 David Khoo <davidk@bii.a-star.edu.sg>
+//
+//  Header file for pool.c
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <pthread.h>
+
+enum {
+	TASK_QUEUED, TASK_RUNNING, TASK_DONE
+};
+
+// A unit of work for the pool, stored by whoever submits it
+typedef struct pool_task {
+	void (*fn)(void *);
+	void *arg;
+	int state;
+	struct pool_task *prev, *next;
+} pool_task;
+
+// A fixed set of worker threads taking tasks from a FIFO queue
+// A pool with no threads runs each task on submission
+typedef struct {
+	pthread_t *threads;
+	int n_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work, done;
+	pool_task *head, *tail;
+	int stop;
+} pool;
+
+int pool_init(pool *, int);
+void pool_submit(pool *, pool_task *, void (*)(void *), void *);
+void pool_wait(pool *, pool_task *);
+int pool_cancel(pool *, pool_task *);
+void pool_destroy(pool *);
+
+#endif /* _POOL_H */
@@ -0,0 +1,87 @@
+//  sha1.c
+//
+//  Copyright 2012 David Khoo <davidk@bii.a-star.edu.sg>
+//
+//  Minimal SHA-1 (FIPS 180-1), as used for the mzXML sha1 element
+
+#include <string.h>
+#include "sha1.h"
+
+#define ROL(x,n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+// Hash one 64 byte block into the state
+static void sha1_block(uint32_t *h, const unsigned char *block) {
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+
+	for (int i = 0; i < 16; ++i)
+		w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i+1] << 16 |
+			(uint32_t)block[4*i+2] << 8 | block[4*i+3];
+	for (int i = 16; i < 80; ++i) w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+	for (int i = 0; i < 80; ++i) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d; d = c; c = ROL(b, 30); b = a; a = t;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+void sha1_init(sha1_ctx *ctx) {
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xEFCDAB89;
+	ctx->h[2] = 0x98BADCFE;
+	ctx->h[3] = 0x10325476;
+	ctx->h[4] = 0xC3D2E1F0;
+	ctx->length = 0;
+	ctx->used = 0;
+}
+
+// Add length bytes of data to the hash
+void sha1_update(sha1_ctx *ctx, const void *data, size_t length) {
+	const unsigned char *p = data;
+
+	ctx->length += length;
+	if (ctx->used > 0) {
+		size_t n = 64 - ctx->used < length ? 64 - ctx->used : length;
+		memcpy(ctx->block + ctx->used, p, n);
+		ctx->used += n;
+		p += n;
+		length -= n;
+		if (ctx->used < 64) return;
+		sha1_block(ctx->h, ctx->block);
+		ctx->used = 0;
+	}
+	for (; length >= 64; p += 64, length -= 64) sha1_block(ctx->h, p);
+	memcpy(ctx->block, p, length);
+	ctx->used = length;
+}
+
+// Pad and finish the hash, storing SHA1_DIGEST_LENGTH bytes in digest
+void sha1_final(sha1_ctx *ctx, unsigned char *digest) {
+	uint64_t bits = ctx->length * 8;
+
+	ctx->block[ctx->used++] = 0x80;
+	if (ctx->used > 56) {
+		memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+		sha1_block(ctx->h, ctx->block);
+		ctx->used = 0;
+	}
+	memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+	for (int i = 0; i < 8; ++i) ctx->block[56 + i] = bits >> (56 - 8*i);
+	sha1_block(ctx->h, ctx->block);
+
+	for (int i = 0; i < SHA1_DIGEST_LENGTH; ++i) digest[i] = ctx->h[i/4] >> (24 - 8*(i%4));
+}
@@ -0,0 +1,26 @@
+//  sha1.h
+//
+//  Copyright 2012 David Khoo <davidk@bii.a-star.edu.sg>
+//
+//  Header file for sha1.c
+
+#ifndef _SHA1_H
+#define _SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_LENGTH 20
+
+typedef struct {
+	uint32_t h[5];
+	uint64_t length; // Bytes hashed so far
+	unsigned char block[64];
+	int used; // Bytes waiting in block
+} sha1_ctx;
+
+void sha1_init(sha1_ctx *);
+void sha1_update(sha1_ctx *, const void *, size_t);
+void sha1_final(sha1_ctx *, unsigned char *);
+
+#endif /* _SHA1_H */
@@ -0,0 +1,161 @@
+// b64bench.c
+//
+// Checks the vector base64 kernels against the libb64 state machine and
+// times encode and decode throughput for each implementation
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "b64/cdecode.h"
+#include "b64/cencode.h"
+
+#define SEED 4242
+#define CHECKS 2000      // Random round trips per implementation
+#define MIN_TIME 2E8     // Minimum time in ns to repeat each measurement
+
+typedef int (*encodefn)(const char*, int, char*, base64_encodestate*);
+typedef int (*decodefn)(const char*, const int, char*, base64_decodestate*);
+
+struct {
+	const char *name;
+	encodefn encode;
+	decodefn decode;
+	const char *feature;
+} impls[] = {
+	{"scalar", base64_encode_block_scalar, base64_decode_block_scalar, NULL},
+#if defined(__x86_64__) || defined(__i386__)
+	{"ssse3", base64_encode_block_ssse3, base64_decode_block_ssse3, "ssse3"},
+	{"avx2", base64_encode_block_avx2, base64_decode_block_avx2, "avx2"},
+#endif
+	{"best", base64_encode_block, base64_decode_block, NULL},
+};
+#define N_IMPLS (int)(sizeof(impls)/sizeof(impls[0]))
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1E9 + ts.tv_nsec;
+}
+
+int supported(int i) {
+#if defined(__x86_64__) || defined(__i386__)
+	if (impls[i].feature && !strcmp(impls[i].feature, "ssse3"))
+		return __builtin_cpu_supports("ssse3");
+	if (impls[i].feature && !strcmp(impls[i].feature, "avx2"))
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+// Encode len bytes in pieces of random size, as a stream would be
+int encode(encodefn fn, const char *in, int len, char *out, int split) {
+	base64_encodestate state;
+	int a = 0, n = 0;
+
+	base64_init_encodestate(&state);
+	while (a < len) {
+		int piece = split ? 1 + rand() % (len - a) : len - a;
+		n += fn(in + a, piece, out + n, &state);
+		a += piece;
+	}
+	return n + base64_encode_blockend(out + n, &state);
+}
+
+// Decode len characters in pieces of random size
+int decode(decodefn fn, const char *in, int len, char *out, int split) {
+	base64_decodestate state;
+	int a = 0, n = 0;
+
+	base64_init_decodestate(&state);
+	while (a < len) {
+		int piece = split ? 1 + rand() % (len - a) : len - a;
+		n += fn(in + a, piece, out + n, &state);
+		a += piece;
+	}
+	return n;
+}
+
+// Copy base64 text, sprinkling in newlines and spaces that decoders skip
+int addwhitespace(const char *in, int len, char *out) {
+	int a, n = 0;
+
+	for (a = 0; a < len; ++a) {
+		if (rand() % 50 == 0) out[n++] = rand() % 2 ? '\n' : ' ';
+		out[n++] = in[a];
+	}
+	return n;
+}
+
+// Compare each implementation against the scalar one on random inputs
+void check(int i) {
+	char *plain = malloc(5000), *ref = malloc(10000), *code = malloc(10000);
+	char *spaced = malloc(20000), *back = malloc(10000);
+	int c;
+
+	for (c = 0; c < CHECKS; ++c) {
+		int len = rand() % 4000, split = c % 2, a;
+		for (a = 0; a < len; ++a) plain[a] = rand();
+
+		int reflen = encode(base64_encode_block_scalar, plain, len, ref, 0);
+		int codelen = encode(impls[i].encode, plain, len, code, split);
+		if (codelen != reflen || memcmp(code, ref, reflen)) {
+			fprintf(stderr, "%s encode mismatch at length %d\n", impls[i].name, len);
+			exit(2);
+		}
+		codelen = strlen(code);
+		if (c % 3 == 0) codelen = addwhitespace(code, codelen, spaced);
+		else memcpy(spaced, code, codelen);
+		if (decode(impls[i].decode, spaced, codelen, back, split) != len ||
+			memcmp(back, plain, len)) {
+			fprintf(stderr, "%s decode mismatch at length %d\n", impls[i].name, len);
+			exit(2);
+		}
+	}
+	free(plain);
+	free(ref);
+	free(code);
+	free(spaced);
+	free(back);
+}
+
+int main(int argc, char** argv)
+{
+	int sizes[] = {1000, 30000, 1000000};
+	int n_sizes = sizeof(sizes)/sizeof(sizes[0]);
+	int i, s;
+
+	srand(SEED);
+	for (i = 0; i < N_IMPLS; ++i) if (supported(i)) check(i);
+	printf("All implementations agree with libb64\n\n");
+
+	printf("%-8s %10s %12s %12s   (MB/s of binary data)\n", "impl", "bytes",
+		"encode", "decode");
+	for (s = 0; s < n_sizes; ++s) {
+		int len = sizes[s];
+		char *plain = malloc(len), *code = malloc(len*2 + 4), *back = malloc(len + 4);
+		int codelen = 0;
+
+		for (i = 0; i < len; ++i) plain[i] = rand();
+		for (i = 0; i < N_IMPLS; ++i) {
+			double start, enc = 0, dec = 0;
+			long reps = 0;
+
+			if (!supported(i)) {
+				printf("%-8s %10d %12s %12s\n", impls[i].name, len, "n/a", "n/a");
+				continue;
+			}
+			for (start = now(); now() - start < MIN_TIME; ++reps)
+				codelen = encode(impls[i].encode, plain, len, code, 0);
+			enc = len * reps / ((now() - start) * 1E-9) / 1E6;
+			for (reps = 0, start = now(); now() - start < MIN_TIME; ++reps)
+				decode(impls[i].decode, code, codelen, back, 0);
+			dec = len * reps / ((now() - start) * 1E-9) / 1E6;
+			printf("%-8s %10d %12.1f %12.1f\n", impls[i].name, len, enc, dec);
+		}
+		free(plain);
+		free(code);
+		free(back);
+	}
+	return 0;
+}
@@ -0,0 +1,171 @@
+// pullbench.c
+//
+// Checks that mzXML_pull reads every scan of a synthetic mzXML file, and
+// copies it back out byte for byte, and compares its throughput with a bare
+// memchr over the same file
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "mxmlmzXML.h"
+#include "mzXMLpull.h"
+
+#define SEED 4242
+#define SCANS 3000       // Scans in the synthetic file
+#define MAX_PEAKS 2000   // Most peaks in a scan
+#define MIN_TIME 2E8     // Minimum time in ns to repeat each measurement
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1E9 + ts.tv_nsec;
+}
+
+// What each scan of the file should read back as
+struct {
+	unsigned int num;
+	int ms_level, precision, compression;
+	double rt;
+	long n;
+	void *pairs;
+} scans[SCANS];
+
+long found; // Kept global, so the baseline is not optimized away
+
+void fail(const char *what, int i) {
+	fprintf(stderr, "%s wrong at scan %d\n", what, i);
+	exit(2);
+}
+
+// Write a file of full scans with MS/MS scans nested in every fifth, in
+// every precision and compressionType, with comments, other elements and
+// an empty peak list in the way
+void make_file(FILE *fp) {
+	static const char *types[] = {"none", "zlib", "tof"};
+
+	fputs("<?xml version=\"1.0\" encoding=\"ISO-8859-1\"?>\n<mzXML xmlns=\"http://sashimi.sourceforge.net/schema_revision/mzXML_3.1\">\n"
+		" <msRun scanCount=\"3000\">\n  <!-- <scan num=\"0\"> in a comment -->\n"
+		"  <dataProcessing centroided=\"0\"><software type=\"conversion\" name=\"x&amp;y\" version=\"1\"/></dataProcessing>\n", fp);
+	for (int i = 0; i < SCANS; ++i) {
+		int precision = i % 2 ? 64 : 32, size = precision/8, nested = i % 5 == 4;
+		long n = rand() % MAX_PEAKS;
+		double *mz = malloc((n + 1) * 2 * size);
+
+		scans[i].num = i + 1;
+		scans[i].ms_level = nested ? 2 : 1;
+		scans[i].precision = precision;
+		scans[i].compression = i % 3;
+		scans[i].rt = i * 0.25;
+		scans[i].n = i % 97 == 50 ? 0 : n;
+		for (long j = 0; j < n; ++j) {
+			double t = 10.0 + (j + 1) * 8.7E-5 * (1 + rand() % 3);
+			if (4 == size) {
+				((float *)mz)[2*j] = t * t;
+				((float *)mz)[2*j+1] = rand() % 50;
+			} else {
+				mz[2*j] = t * t;
+				mz[2*j+1] = rand() % 50;
+			}
+		}
+		scans[i].pairs = mz;
+
+		if (nested) fputs("  ", fp);
+		fprintf(fp, "  <scan num=\"%u\"\n   msLevel='%d' peaksCount=\"%ld\" polarity=\"+\" scanType=\"%s\" retentionTime=\"PT%gS\" lowMz=\"100.5\" highMz=\"%d\" comment=\"a > b\">\n",
+			scans[i].num, scans[i].ms_level, scans[i].n, nested ? "MSMS" : "Full", scans[i].rt, 2000 + i);
+		if (nested) fputs("   <precursorMz precursorIntensity=\"10\">500.25</precursorMz>\n", fp);
+		if (scans[i].n == 0) {
+			fprintf(fp, "   <peaks precision=\"%d\" byteOrder=\"network\" pairOrder=\"m/z-int\" compressionType=\"none\" compressedLen=\"0\"/>\n", precision);
+			scans[i].compression = PEAKS_NONE;
+		} else {
+			char *coded = mzXML_encode(mz, 2*n*size, scans[i].compression, precision);
+			fprintf(fp, "   <peaks precision=\"%d\" byteOrder=\"network\" pairOrder=\"m/z-int\" compressionType=\"%s\" compressedLen=\"%ld\">%s</peaks>\n",
+				precision, types[scans[i].compression], 2*n*size, coded);
+			free(coded);
+		}
+		fputs(i % 5 == 3 ? "" : "  </scan>\n", fp);
+		if (nested) fputs("  </scan>\n", fp);
+	}
+	fputs(" </msRun>\n <index name=\"scan\">\n  <offset id=\"1\">0</offset>\n </index>\n <indexOffset>0</indexOffset>\n</mzXML>\n", fp);
+}
+
+// Pull every scan and check it against what was written
+void check(mzXML_pull *p) {
+	mzXML_scan *s;
+	int i = 0;
+
+	for (; (s = mzXML_pull_next(p)) != NULL; ++i) {
+		if (i >= SCANS || s->num != scans[i].num) fail("num", i);
+		if (strncmp(p->data + s->offset, "<scan", 5)) fail("offset", i);
+		if (s->ms_level != scans[i].ms_level || s->polarity != '+' || s->rt != scans[i].rt ||
+			s->low_mz != 100.5 || s->high_mz != 2000 + i || s->peaks_count != scans[i].n ||
+			strcmp(s->scan_type, s->ms_level == 2 ? "MSMS" : "Full")) fail("attributes", i);
+		if (s->precision != scans[i].precision || s->compression != scans[i].compression) fail("peaks attributes", i);
+		if (scans[i].n == 0) {
+			if (s->payload) fail("empty peaks", i);
+			continue;
+		}
+
+		long length;
+		void *pairs = mzXML_decode(s->payload, s->payload_len, s->compression, s->zlib_len, s->precision, &length);
+		if (!pairs || length != 2*scans[i].n*(s->precision/8) || memcmp(pairs, scans[i].pairs, length))
+			fail("peak list", i);
+		free(pairs);
+	}
+	if (i != SCANS) fail("count", i);
+	if (strncmp(p->data + p->tail, " <index", 7)) fail("tail", i);
+}
+
+int main(int argc, char** argv) {
+	char name[] = "/tmp/pullbenchXXXXXX", copy_name[] = "/tmp/pullbenchXXXXXX";
+	int fd = mkstemp(name), copy_fd = mkstemp(copy_name);
+	FILE *fp = fdopen(fd, "w"), *copy = fdopen(copy_fd, "w+");
+	mzXML_pull *p;
+	double start;
+	long reps;
+
+	srand(SEED);
+	make_file(fp);
+	fclose(fp);
+	if (!(p = mzXML_pull_open(name))) {
+		fprintf(stderr, "Could not open %s\n", name);
+		return 2;
+	}
+	check(p);
+
+	// Copying everything but the peak lists, and then them, gives the file back
+	p->pos = p->copied = 0;
+	for (mzXML_scan *s; (s = mzXML_pull_next(p)) != NULL; ) {
+		if (!s->payload) continue;
+		mzXML_pull_copy(p, copy, s->payload - p->data);
+		fwrite(s->payload, 1, s->payload_len, copy);
+		mzXML_pull_skip(p, s->payload - p->data + s->payload_len);
+	}
+	mzXML_pull_copy(p, copy, p->size);
+	fflush(copy);
+	char *back = malloc(p->size);
+	if (ftell(copy) != p->size || pread(copy_fd, back, p->size, 0) != p->size || memcmp(back, p->data, p->size))
+		fail("copy", 0);
+	free(back);
+	printf("All scans pulled and copied back exactly\n\n");
+
+	printf("%-8s %10s %12s   (MB/s of mzXML)\n", "parser", "bytes", "throughput");
+	for (reps = 0, start = now(); now() - start < MIN_TIME; ++reps) {
+		p->pos = 0;
+		for (found = 0; mzXML_pull_next(p); ++found);
+	}
+	printf("%-8s %10ld %12.1f\n", "pull", p->size, p->size * reps / ((now() - start) * 1E-9) / 1E6);
+	for (reps = 0, start = now(); now() - start < MIN_TIME; ++reps) {
+		const char *q = p->data, *end = p->data + p->size;
+		for (found = 0; (q = memchr(q, '<', end - q)); ++q) ++found;
+	}
+	printf("%-8s %10ld %12.1f\n", "memchr", p->size, p->size * reps / ((now() - start) * 1E-9) / 1E6);
+
+	mzXML_pull_close(p);
+	fclose(copy);
+	unlink(name);
+	unlink(copy_name);
+	for (int i = 0; i < SCANS; ++i) free(scans[i].pairs);
+	return 0;
+}
@@ -0,0 +1,162 @@
+// tofbench.c
+//
+// Checks that every tof_decode implementation restores peak lists exactly,
+// and compares size and decode throughput with zlib
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "tofcodec.h"
+#include "easyzlib.h"
+
+#define SEED 4242
+#define CHECKS 2000      // Random round trips per implementation and precision
+#define MIN_TIME 2E8     // Minimum time in ns to repeat each measurement
+#define GRID_START 10.0  // sqrt(100 m/z)
+#define GRID_GAP 8.7E-5  // TOF grid step of the Qtof in sqrt(m/z)
+
+typedef long (*decodefn)(const unsigned char *, long, int, void **);
+
+struct {
+	const char *name;
+	decodefn decode;
+	const char *feature;
+} impls[] = {
+	{"scalar", tof_decode_scalar, NULL},
+#if defined(__x86_64__) || defined(__i386__)
+	{"avx2", tof_decode_avx2, "avx2"},
+#endif
+	{"best", tof_decode, NULL},
+};
+#define N_IMPLS (int)(sizeof(impls)/sizeof(impls[0]))
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1E9 + ts.tv_nsec;
+}
+
+int supported(int i) {
+#if defined(__x86_64__) || defined(__i386__)
+	if (impls[i].feature && !strcmp(impls[i].feature, "avx2"))
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+// Fill n peaks on the TOF grid, as profile runs around random centres with
+// ion counts, intensities rounded to 0.01, or fractional (deadtime
+// corrected) intensities
+enum { COUNTS, ROUNDED, FRACTIONAL };
+void make_peaks(void *pairs, long n, int precision, int kind) {
+	long bin = rand() % 1000;
+
+	for (long i = 0; i < n; ++i) {
+		bin += rand() % 4 ? 1 : 1 + rand() % 500;
+		double t = GRID_START + bin * GRID_GAP, mz = t * t;
+		double I = rand() / (double)RAND_MAX * 100;
+		if (kind == COUNTS) I = rand() % 50;
+		else if (kind == ROUNDED) I = round(I * 100) / 100;
+		if (32 == precision) {
+			((float *)pairs)[2*i] = mz;
+			((float *)pairs)[2*i+1] = I;
+		} else {
+			((double *)pairs)[2*i] = mz;
+			((double *)pairs)[2*i+1] = I;
+		}
+	}
+}
+
+// Peak lists the grid does not suit: unsorted, random, negative or NaN m/z,
+// with a negative zero I to keep
+void make_odd_peaks(void *pairs, long n, int precision, int kind) {
+	for (long i = 0; i < n; ++i) {
+		double mz = kind == 0 ? rand() / (double)RAND_MAX * 2000 : 100 + i;
+		if (kind == 1 && i == n/2) mz = -1;
+		if (kind == 2 && i == n/2) mz = NAN;
+		if (32 == precision) {
+			((float *)pairs)[2*i] = mz;
+			((float *)pairs)[2*i+1] = i == 0 ? -0.0 : rand() % 7;
+		} else {
+			((double *)pairs)[2*i] = mz;
+			((double *)pairs)[2*i+1] = i == 0 ? -0.0 : rand() % 7;
+		}
+	}
+}
+
+// Round trip random peak lists through each implementation
+void check(int i) {
+	void *pairs = malloc(5000 * 16), *back;
+	unsigned char *code;
+
+	for (int c = 0; c < CHECKS; ++c) {
+		int precision = c % 2 ? 64 : 32, size = precision/8;
+		long n = rand() % (c % 10 ? 5000 : 3);
+		if (c % 7 == 6) make_odd_peaks(pairs, n, precision, c % 3);
+		else make_peaks(pairs, n, precision, c % 3);
+
+		long length = tof_encode(pairs, 2*n*size, precision, &code);
+		if (impls[i].decode(code, length, precision, &back) != 2*n*size ||
+			memcmp(back, pairs, 2*n*size)) {
+			fprintf(stderr, "%s mismatch at %d bit with %ld peaks\n", impls[i].name, precision, n);
+			exit(2);
+		}
+		free(back);
+
+		// A stream cut short must be rejected, not read past
+		if (length > 3 && impls[i].decode(code, length - 1 - rand() % 3, precision, &back) >= 0) {
+			fprintf(stderr, "%s accepted a cut stream with %ld peaks\n", impls[i].name, n);
+			exit(2);
+		}
+		free(code);
+	}
+	free(pairs);
+}
+
+int main(int argc, char** argv) {
+	long n = 200000;
+
+	srand(SEED);
+	for (int i = 0; i < N_IMPLS; ++i) if (supported(i)) check(i);
+	printf("All implementations restore peak lists exactly\n\n");
+
+	printf("%-8s %3s %10s %10s %12s   (MB/s of decoded peaks)\n", "impl", "bit", "raw", "coded", "decode");
+	for (int precision = 32; precision <= 64; precision += 32) {
+		long length = 2*n*(precision/8), coded, zlen = EZ_COMPRESSMAXDESTLENGTH(length);
+		void *pairs = malloc(length), *back;
+		unsigned char *code, *zcode = malloc(zlen), *zback = malloc(length);
+		double start;
+		long reps;
+
+		make_peaks(pairs, n, precision, COUNTS);
+		coded = tof_encode(pairs, length, precision, &code);
+		ezcompress(zcode, &zlen, pairs, length);
+
+		for (int i = 0; i < N_IMPLS; ++i) {
+			if (!supported(i)) {
+				printf("%-8s %3d %10ld %10s %12s\n", impls[i].name, precision, length, "n/a", "n/a");
+				continue;
+			}
+			for (reps = 0, start = now(); now() - start < MIN_TIME; ++reps) {
+				impls[i].decode(code, coded, precision, &back);
+				free(back);
+			}
+			printf("%-8s %3d %10ld %10ld %12.1f\n", impls[i].name, precision, length, coded,
+				length * reps / ((now() - start) * 1E-9) / 1E6);
+		}
+		for (reps = 0, start = now(); now() - start < MIN_TIME; ++reps) {
+			long back_length = length;
+			ezuncompress(zback, &back_length, zcode, zlen);
+		}
+		printf("%-8s %3d %10ld %10ld %12.1f\n", "zlib", precision, length, zlen,
+			length * reps / ((now() - start) * 1E-9) / 1E6);
+
+		free(pairs);
+		free(code);
+		free(zcode);
+		free(zback);
+	}
+	return 0;
+}
@@ -0,0 +1,452 @@
+//  tofcodec.c
+//
+//  Copyright 2012 David Khoo <davidk@bii.a-star.edu.sg>
+//
+//  Lossless coding of peak lists as TOF grid indices (compressionType "tof")
+//
+//  TOF m/z values lie on a grid even in sqrt(m/z), so each m/z is coded as
+//  its step in grid bins from the previous one, and the difference in ulps
+//  between its exact bits and the value predicted from an anchor peak on
+//  the grid. The anchor moves on whenever the prediction drifts, so the
+//  differences stay within a byte. Intensities that are all whole numbers
+//  of 1, 0.1, 0.01 or 0.001 (ion counts, or rounded values) are coded as
+//  varints of that quantum, others as raw bits. A list the grid does not suit
+//  is stored raw. All fields are little-endian, and peak lists are host order.
+//
+//  Stream: version, flags, varint n, then unless TOF_RAW: grid step (double),
+//  first m/z and I, and for each further peak varint zigzag(dk),
+//  varint zigzag(residual) << 1 | anchor, and I.
+
+// Prediction must round the same on every machine and implementation
+#pragma GCC optimize ("fp-contract=off")
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "tofcodec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#define TOF_VERSION 1
+#define TOF_64 1 // 64 bit precision
+#define TOF_INT 2 // Intensities are varints of a quantum
+#define TOF_RAW 4 // Peak pairs stored raw
+#define TOF_QUANTUM 3 // Shift of the quantum exponent in flags, 0 for 1 to 3 for 0.001
+#define TOF_QUANTA 4
+#define TOF_ANCHOR 16 // Residual in ulps beyond which the anchor moves on
+#define TOF_MAX_DK 1E12 // Largest grid step between peaks coded
+
+// Read and write little-endian fields and varints
+static unsigned char *put_le(unsigned char *p, uint64_t x, int bytes) {
+	for (int i = 0; i < bytes; ++i) *p++ = x >> (8*i);
+	return p;
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes) {
+	uint64_t x = 0;
+	for (int i = 0; i < bytes; ++i) x |= (uint64_t)p[i] << (8*i);
+	return x;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t x) {
+	while (x >= 0x80) {
+		*p++ = x | 0x80;
+		x >>= 7;
+	}
+	*p++ = x;
+	return p;
+}
+
+// Returns NULL if the varint runs past end
+static const unsigned char *get_varint(const unsigned char *p, const unsigned char *end, uint64_t *x) {
+	uint64_t v = 0;
+	int shift = 0;
+
+	if (p < end && *p < 0x80) {
+		*x = *p;
+		return p + 1;
+	}
+	while (p < end && shift < 64) {
+		v |= (uint64_t)(*p & 0x7F) << shift;
+		if (!(*p++ & 0x80)) {
+			*x = v;
+			return p;
+		}
+		shift += 7;
+	}
+	return NULL;
+}
+
+static uint64_t zigzag(int64_t x) {
+	return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63);
+}
+
+static int64_t unzigzag(uint64_t x) {
+	return (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+}
+
+// Bits of the m/z predicted offset bins from an anchor at TOF t
+static uint64_t tof_predict(double t, double offset, double gap, int precision) {
+	double mz = t + offset * gap;
+	mz *= mz;
+	if (32 == precision) {
+		float f = mz;
+		uint32_t bits;
+		memcpy(&bits, &f, 4);
+		return bits;
+	} else {
+		uint64_t bits;
+		memcpy(&bits, &mz, 8);
+		return bits;
+	}
+}
+
+// m/z and I of peak i, and the bits of its m/z
+static double peak_mz(const void *pairs, long i, int precision) {
+	return 32 == precision ? ((const float *)pairs)[2*i] : ((const double *)pairs)[2*i];
+}
+
+static double peak_I(const void *pairs, long i, int precision) {
+	return 32 == precision ? ((const float *)pairs)[2*i+1] : ((const double *)pairs)[2*i+1];
+}
+
+// Intensity of quantum q from its count x
+static const double quanta[TOF_QUANTA] = {1, 10, 100, 1000};
+
+static uint64_t quantum_bits(uint64_t x, int q, int precision) {
+	double I = q ? x / quanta[q] : x;
+	if (32 == precision) {
+		float f = I;
+		uint32_t bits;
+		memcpy(&bits, &f, 4);
+		return bits;
+	} else {
+		uint64_t bits;
+		memcpy(&bits, &I, 8);
+		return bits;
+	}
+}
+
+static uint64_t peak_bits(const void *pairs, long i, int precision) {
+	if (32 == precision) {
+		uint32_t bits;
+		memcpy(&bits, (const float *)pairs + 2*i, 4);
+		return bits;
+	} else {
+		uint64_t bits;
+		memcpy(&bits, (const double *)pairs + 2*i, 8);
+		return bits;
+	}
+}
+
+// Estimate the grid step in TOF from the gaps between neighbouring peaks
+// The smallest gap is refined by averaging over gaps of a few steps, as each
+// one is only as exact as the m/z it comes from. Returns 0 if there is no grid.
+double tof_grid(const void *pairs, long n, int precision) {
+	double gap = INFINITY, last = sqrt(peak_mz(pairs, 0, precision));
+
+	for (long i = 1; i < n; ++i) {
+		double t = sqrt(peak_mz(pairs, i, precision));
+		if (t - last > 0 && t - last < gap) gap = t - last;
+		last = t;
+	}
+	if (!isfinite(gap)) return 0;
+
+	for (int pass = 0; pass < 3; ++pass) {
+		double sum_gap = 0, sum_steps = 0;
+		last = sqrt(peak_mz(pairs, 0, precision));
+		for (long i = 1; i < n; ++i) {
+			double t = sqrt(peak_mz(pairs, i, precision)), steps = (t - last) / gap;
+			long k = lround(steps);
+			if (k >= 1 && k <= 4 && fabs(steps - k) < 0.25) {
+				sum_gap += t - last;
+				sum_steps += k;
+			}
+			last = t;
+		}
+		if (sum_steps > 0) gap = sum_gap / sum_steps;
+	}
+	return gap;
+}
+
+// Find the largest quantum all intensities are exact whole numbers of
+// Returns its exponent, or -1 if there is none
+static int tof_quantum(const void *pairs, long n, int precision) {
+	int size = precision/8;
+
+	for (int q = 0; q < TOF_QUANTA; ++q) {
+		long i;
+		for (i = 0; i < n; ++i) {
+			double x = peak_I(pairs, i, precision) * quanta[q];
+			if (!(x >= 0 && x < 9007199254740992.0)) break;
+			if (quantum_bits(llround(x), q, precision) != peak_bits((const char *)pairs + size, i, precision)) break;
+		}
+		if (i == n) return q;
+	}
+	return (-1);
+}
+
+// Code peaks 1.. of a list with a grid of the given step, after the header
+// Returns the end of the stream, or NULL if a peak is too far off the grid
+static unsigned char *tof_encode_grid(const void *pairs, long n, int precision, int flags, double gap, unsigned char *p) {
+	int size = precision/8;
+	double anchor = sqrt(peak_mz(pairs, 0, precision)), last = anchor, offset = 0;
+	uint64_t gap_bits;
+
+	memcpy(&gap_bits, &gap, 8);
+	p = put_le(p, gap_bits, 8);
+	p = put_le(p, peak_bits(pairs, 0, precision), size);
+	for (long i = 0; i < n; ++i) {
+		if (i > 0) {
+			double t = sqrt(peak_mz(pairs, i, precision)), steps = (t - last) / gap;
+			if (!(fabs(steps) < TOF_MAX_DK)) return NULL;
+			int64_t dk = llround(steps);
+			offset += dk;
+
+			uint64_t predicted = tof_predict(anchor, offset, gap, precision);
+			int64_t residual = (int64_t)(peak_bits(pairs, i, precision) - predicted);
+			if (32 == precision) residual = (int32_t)residual;
+			if (residual > INT64_MAX/4 || residual < -INT64_MAX/4) return NULL;
+
+			// Move the anchor here once the prediction drifts
+			int move = residual > TOF_ANCHOR || residual < -TOF_ANCHOR;
+			p = put_varint(p, zigzag(dk));
+			p = put_varint(p, zigzag(residual) << 1 | move);
+			if (move) {
+				anchor = t;
+				offset = 0;
+			}
+			last = t;
+		}
+		if (flags & TOF_INT) p = put_varint(p, llround(peak_I(pairs, i, precision) * quanta[flags >> TOF_QUANTUM]));
+		else p = put_le(p, peak_bits((const char *)pairs + size, i, precision), size);
+	}
+	return p;
+}
+
+// Store n peaks raw after the header
+static unsigned char *tof_encode_raw(const void *pairs, long n, int precision, unsigned char *p) {
+	int size = precision/8;
+
+	for (long i = 0; i < 2*n; ++i) {
+		uint64_t bits = 0;
+		memcpy(&bits, (const char *)pairs + i*size, size);
+		p = put_le(p, bits, size);
+	}
+	return p;
+}
+
+// Encode length bytes of host order peak pairs into *out, returning its
+// length
+long tof_encode(const void *pairs, long length, int precision, unsigned char **out) {
+	int size = precision/8;
+	long n = length/(2*size);
+	unsigned char flags = 64 == precision ? TOF_64 : 0, *p, *end = NULL;
+	double gap = 0;
+
+	// The grid needs finite, non-negative m/z
+	for (long i = 0; i < n; ++i) {
+		double mz = peak_mz(pairs, i, precision);
+		if (!(mz >= 0 && mz < INFINITY)) flags |= TOF_RAW;
+	}
+	if (n < 2) flags |= TOF_RAW;
+	if (!(flags & TOF_RAW)) {
+		int q = tof_quantum(pairs, n, precision);
+		if (q >= 0) flags |= TOF_INT | q << TOF_QUANTUM;
+		gap = tof_grid(pairs, n, precision);
+	}
+
+	// Varints take at most 10 bytes
+	*out = malloc(2 + 10 + 8 + length + 30*n);
+	p = *out;
+	*p++ = TOF_VERSION;
+	p++;
+	p = put_varint(p, n);
+	if (gap > 0) end = tof_encode_grid(pairs, n, precision, flags, gap, p);
+
+	// Fall back to raw if the grid does not fit or gains nothing
+	if (!end || end - p >= length) {
+		flags = (flags & TOF_64) | TOF_RAW;
+		end = tof_encode_raw(pairs, n, precision, p);
+	}
+	(*out)[1] = flags;
+
+	long out_length = end - *out;
+	*out = realloc(*out, out_length);
+	return out_length;
+}
+
+// Fill in the m/z of peaks from up to to, predicted from an anchor at TOF t
+// with offsets in grid steps, and corrected by residuals in ulps
+static void tof_fill_scalar(double t, double gap, const double *offsets, const int64_t *residuals,
+		void *pairs, long from, long to, int precision) {
+	for (long i = from; i < to; ++i) {
+		uint64_t bits = tof_predict(t, offsets[i], gap, precision) + residuals[i];
+		if (32 == precision) {
+			uint32_t bits32 = bits;
+			memcpy((float *)pairs + 2*i, &bits32, 4);
+		} else memcpy((double *)pairs + 2*i, &bits, 8);
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+// AVX2 kernel, 4 peaks per step, interleaving m/z with the I already there
+__attribute__((target("avx2")))
+static void tof_fill_avx2(double t, double gap, const double *offsets, const int64_t *residuals,
+		void *pairs, long from, long to, int precision) {
+	const __m256d anchor = _mm256_set1_pd(t), step = _mm256_set1_pd(gap);
+	long i = from;
+
+	if (32 == precision) {
+		float *p = pairs;
+		const __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+		const __m256i spread = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+		for (; i + 4 <= to; i += 4) {
+			__m256d mz = _mm256_add_pd(anchor, _mm256_mul_pd(_mm256_loadu_pd(offsets + i), step));
+			__m128i bits = _mm_castps_si128(_mm256_cvtpd_ps(_mm256_mul_pd(mz, mz)));
+			__m256i residual = _mm256_loadu_si256((const __m256i *)(residuals + i));
+			bits = _mm_add_epi32(bits, _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(residual, pack)));
+			__m256i pair = _mm256_loadu_si256((const __m256i *)(p + 2*i));
+			pair = _mm256_blend_epi32(pair, _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(bits), spread), 0x55);
+			_mm256_storeu_si256((__m256i *)(p + 2*i), pair);
+		}
+	} else {
+		double *p = pairs;
+		for (; i + 4 <= to; i += 4) {
+			__m256d mz = _mm256_add_pd(anchor, _mm256_mul_pd(_mm256_loadu_pd(offsets + i), step));
+			__m256i bits = _mm256_castpd_si256(_mm256_mul_pd(mz, mz));
+			bits = _mm256_add_epi64(bits, _mm256_loadu_si256((const __m256i *)(residuals + i)));
+			__m256i low = _mm256_loadu_si256((const __m256i *)(p + 2*i));
+			__m256i high = _mm256_loadu_si256((const __m256i *)(p + 2*i + 4));
+			low = _mm256_blend_epi32(low, _mm256_permute4x64_epi64(bits, _MM_SHUFFLE(1, 1, 0, 0)), 0x33);
+			high = _mm256_blend_epi32(high, _mm256_permute4x64_epi64(bits, _MM_SHUFFLE(3, 3, 2, 2)), 0x33);
+			_mm256_storeu_si256((__m256i *)(p + 2*i), low);
+			_mm256_storeu_si256((__m256i *)(p + 2*i + 4), high);
+		}
+	}
+	tof_fill_scalar(t, gap, offsets, residuals, pairs, i, to, precision);
+}
+#endif
+
+typedef void (*tof_fill_fn)(double, double, const double *, const int64_t *, void *, long, long, int);
+
+// Decode a stream of length bytes into *out as host order peak pairs of the
+// given precision, returning their length in bytes, or -1 if it is corrupt
+// Varints are read in one pass, then m/z filled in between anchors by fill.
+static long tof_decode_with(tof_fill_fn fill, const unsigned char *in, long length, int precision, void **out) {
+	const unsigned char *p = in + 2, *end = in + length;
+	int size = precision/8, flags;
+	uint64_t n, x;
+
+	*out = NULL;
+	if (length < 3 || in[0] != TOF_VERSION) return (-1);
+	flags = in[1];
+	if (flags >> TOF_QUANTUM >= TOF_QUANTA) return (-1);
+	if (!(flags & TOF_64) != (32 == precision)) return (-1);
+	if (!(p = get_varint(p, end, &n)) || n > length) return (-1);
+	*out = malloc(n > 0 ? 2*n*size : 1);
+
+	if (flags & TOF_RAW) {
+		if (end - p < 2*n*size) goto corrupt;
+		for (long i = 0; i < 2*n; ++i) {
+			uint64_t bits = get_le(p + i*size, size);
+			memcpy((char *)*out + i*size, &bits, size);
+		}
+		return 2*n*size;
+	}
+
+	if (n == 0 || end - p < 8 + size) goto corrupt;
+	uint64_t gap_bits = get_le(p, 8), first = get_le(p + 8, size);
+	double gap;
+	memcpy(&gap, &gap_bits, 8);
+	memcpy(*out, &first, size);
+	p += 8 + size;
+
+	// Offsets from the anchor, residuals and the peaks where the anchor moves
+	double *offsets = malloc(n * (sizeof(double) + sizeof(int64_t) + sizeof(long)));
+	int64_t *residuals = (int64_t *)(offsets + n);
+	long *moves = (long *)(residuals + n), n_moves = 0;
+	double offset = 0;
+
+	for (long i = 0; i < n; ++i) {
+		if (i > 0) {
+			if (!(p = get_varint(p, end, &x))) break;
+			offset += unzigzag(x);
+			if (!(p = get_varint(p, end, &x))) break;
+			offsets[i] = offset;
+			residuals[i] = unzigzag(x >> 1);
+			if (x & 1) {
+				moves[n_moves++] = i;
+				offset = 0;
+			}
+		}
+		if (flags & TOF_INT) {
+			if (!(p = get_varint(p, end, &x))) break;
+			uint64_t bits = quantum_bits(x, flags >> TOF_QUANTUM, precision);
+			memcpy((char *)*out + (2*i+1)*size, &bits, size);
+		} else {
+			if (end - p < size) {
+				p = NULL;
+				break;
+			}
+			uint64_t bits = get_le(p, size);
+			memcpy((char *)*out + (2*i+1)*size, &bits, size);
+			p += size;
+		}
+	}
+	if (!p) {
+		free(offsets);
+		goto corrupt;
+	}
+
+	// Each anchor predicts the peaks up to and including the next one
+	double t = sqrt(peak_mz(*out, 0, precision));
+	long from = 1;
+	for (long j = 0; j <= n_moves; ++j) {
+		long to = j < n_moves ? moves[j] + 1 : n;
+		fill(t, gap, offsets, residuals, *out, from, to, precision);
+		if (j < n_moves) t = sqrt(peak_mz(*out, moves[j], precision));
+		from = to;
+	}
+	free(offsets);
+	return 2*n*size;
+
+corrupt:
+	free(*out);
+	*out = NULL;
+	return (-1);
+}
+
+long tof_decode_scalar(const unsigned char *in, long length, int precision, void **out) {
+	return tof_decode_with(tof_fill_scalar, in, length, precision, out);
+}
+
+#ifdef HAVE_X86_SIMD
+long tof_decode_avx2(const unsigned char *in, long length, int precision, void **out) {
+	return tof_decode_with(tof_fill_avx2, in, length, precision, out);
+}
+#endif
+
+// Pick the best kernel for this CPU on first call
+static void tof_fill_init(double, double, const double *, const int64_t *, void *, long, long, int);
+static tof_fill_fn tof_fill_kernel = tof_fill_init;
+
+static void tof_fill_init(double t, double gap, const double *offsets, const int64_t *residuals,
+		void *pairs, long from, long to, int precision) {
+	tof_fill_fn kernel = tof_fill_scalar;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) kernel = tof_fill_avx2;
+#endif
+	// Threads racing here all pick the same kernel
+	__atomic_store_n(&tof_fill_kernel, kernel, __ATOMIC_RELAXED);
+	kernel(t, gap, offsets, residuals, pairs, from, to, precision);
+}
+
+long tof_decode(const unsigned char *in, long length, int precision, void **out) {
+	return tof_decode_with(__atomic_load_n(&tof_fill_kernel, __ATOMIC_RELAXED), in, length, precision, out);
+}
@@ -0,0 +1,20 @@
+//  tofcodec.h
+//
+//  Copyright 2012 David Khoo <davidk@bii.a-star.edu.sg>
+//
+//  Header file for tofcodec.c
+
+#ifndef _TOFCODEC_H
+#define _TOFCODEC_H
+
+long tof_encode(const void *, long, int, unsigned char **);
+long tof_decode(const unsigned char *, long, int, void **);
+double tof_grid(const void *, long, int);
+
+// Fixed implementations of tof_decode, for testing
+long tof_decode_scalar(const unsigned char *, long, int, void **);
+#if defined(__x86_64__) || defined(__i386__)
+long tof_decode_avx2(const unsigned char *, long, int, void **);
+#endif
+
+#endif /* _TOFCODEC_H */